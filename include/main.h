@@ -2,10 +2,35 @@
 #define MAIN_H
 
 #include <iostream>
+#include <string>
 #include <cmath>
 #include <vector>
+#include <unordered_map>
 #include <algorithm>
 #include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <chrono>
+#include <cctype>
+#include <cstdint>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
 
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -15,11 +40,6 @@ extern "C" {
 #include <libswscale/swscale.h>
 }
 
-#define WIDTH 1920
-#define HEIGHT 1080
-#define FPS 30
-#define DURATION 5
-#define TOTAL_FRAMES (FPS * DURATION)
 #define PI 3.14159265359
 
 #endif
\ No newline at end of file
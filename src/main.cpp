@@ -114,6 +114,15 @@ struct Mat4 {
         return mat;
     }
     
+    // Create scale matrix
+    static Mat4 scale(float x, float y, float z) {
+        Mat4 mat;
+        mat.m[0][0] = x;
+        mat.m[1][1] = y;
+        mat.m[2][2] = z;
+        return mat;
+    }
+    
     // Create perspective projection matrix
     static Mat4 perspective(float fov, float aspect, float near, float far) {
         Mat4 mat;
@@ -131,445 +140,5884 @@ struct Mat4 {
 };
 
 // ============================================================================
-// 3D Renderer
+// Telemetry
 // ============================================================================
 
-struct Color {
-    uint8_t r, g, b, a;
-    Color(uint8_t r, uint8_t g, uint8_t b, uint8_t a = 255) : r(r), g(g), b(b), a(a) {}
-};
+// Per-frame stages timed on every run. Encode includes the mux of whatever
+// packets the frame released; decode is the screen texture's.
+enum Stage { STAGE_COMPOSE, STAGE_CLEAR, STAGE_RASTER, STAGE_CONVERT, STAGE_COPY, STAGE_CACHE, STAGE_ENCODE, STAGE_MUX,
+             STAGE_DECODE, STAGE_COUNT };
 
-class Framebuffer {
+static const char* const STAGE_NAMES[STAGE_COUNT] = {"compose", "clear", "raster", "convert", "copy", "cache",
+                                                      "encode", "mux", "decode"};
+
+// Stage timings for the exit summary and, optionally, a Chrome trace. Events
+// come a few per frame, so one lock is cheap enough.
+class Telemetry {
 private:
-    int width, height;
-    std::vector<Color> pixels;
-    std::vector<float> depthBuffer;
-    
+    struct Event {
+        int stage;
+        int frame;      // -1 when the stage is not tied to a frame
+        int thread;
+        int64_t start, end;     // Nanoseconds since the telemetry was created
+    };
+
+    std::chrono::steady_clock::time_point origin;
+    std::mutex mutex;
+    std::vector<Event> events;
+    std::vector<std::string> threadNames;
+    std::atomic<int> threadCount;
+
+    int threadId() {
+        thread_local int id = threadCount++;
+        return id;
+    }
+
+    static double ms(int64_t ns) { return ns / 1e6; }
+
 public:
-    Framebuffer(int w, int h) : width(w), height(h) {
-        pixels.resize(w * h, Color(0, 0, 0));
-        depthBuffer.resize(w * h, 1.0f);
+    std::atomic<uint64_t> bytesMuxed;
+
+    Telemetry() : origin(std::chrono::steady_clock::now()), threadCount(0), bytesMuxed(0) {}
+
+    int64_t now() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
     }
-    
-    void clear(const Color& color) {
-        std::fill(pixels.begin(), pixels.end(), color);
-        std::fill(depthBuffer.begin(), depthBuffer.end(), 1.0f);
+
+    void record(Stage stage, int frame, int64_t start, int64_t end) {
+        int thread = threadId();
+        std::lock_guard<std::mutex> lock(mutex);
+        events.push_back({stage, frame, thread, start, end});
     }
-    
-    void setPixel(int x, int y, float depth, const Color& color) {
-        if (x < 0 || x >= width || y < 0 || y >= height) return;
-        
-        int idx = y * width + x;
-        if (depth < depthBuffer[idx]) {
-            depthBuffer[idx] = depth;
-            pixels[idx] = color;
+
+    // Label the calling thread in the trace
+    void nameThread(const std::string& name) {
+        int thread = threadId();
+        std::lock_guard<std::mutex> lock(mutex);
+        if ((int)threadNames.size() <= thread) threadNames.resize(thread + 1);
+        threadNames[thread] = name;
+    }
+
+    // Calls, total and nearest-rank percentiles of each stage that ran
+    void printSummary() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<int64_t> durations[STAGE_COUNT];
+        for (const Event& event : events) durations[event.stage].push_back(event.end - event.start);
+
+        bool header = false;
+        for (int stage = 0; stage < STAGE_COUNT; stage++) {
+            std::vector<int64_t>& d = durations[stage];
+            if (d.empty()) continue;
+            std::sort(d.begin(), d.end());
+            int64_t total = 0;
+            for (int64_t ns : d) total += ns;
+            auto percentile = [&d](int p) { return d[std::max<size_t>(1, (d.size() * p + 99) / 100) - 1]; };
+
+            if (!header) std::cout << "Stage timings:" << std::endl;
+            header = true;
+            std::cout << "  " << STAGE_NAMES[stage] << ": " << d.size() << " calls, " << ms(total) << " ms total, p50 "
+                      << ms(percentile(50)) << " ms, p95 " << ms(percentile(95)) << " ms, p99 " << ms(percentile(99))
+                      << " ms, max " << ms(d.back()) << " ms" << std::endl;
         }
+        if (bytesMuxed > 0) std::cout << "Muxed " << bytesMuxed << " bytes" << std::endl;
+    }
+
+    // Chrome trace event JSON, for chrome://tracing or Perfetto: one complete
+    // event per stage on the thread that ran it
+    bool writeTrace(const std::string& path) {
+        FILE* file = std::fopen(path.c_str(), "w");
+        if (!file) {
+            std::cerr << "Cannot write trace " << path << std::endl;
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        std::fprintf(file, "{\"traceEvents\":[\n");
+        bool first = true;
+        for (size_t thread = 0; thread < threadNames.size(); thread++) {
+            if (threadNames[thread].empty()) continue;
+            std::fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                         first ? "" : ",\n", (int)thread, threadNames[thread].c_str());
+            first = false;
+        }
+        for (const Event& event : events) {
+            std::fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                         first ? "" : ",\n", STAGE_NAMES[event.stage], event.thread, event.start / 1e3,
+                         (event.end - event.start) / 1e3);
+            if (event.frame >= 0) std::fprintf(file, ",\"args\":{\"frame\":%d}", event.frame);
+            std::fprintf(file, "}");
+            first = false;
+        }
+        std::fprintf(file, "\n]}\n");
+        return std::fclose(file) == 0;
     }
-    
-    const Color* getData() const { return pixels.data(); }
-    int getWidth() const { return width; }
-    int getHeight() const { return height; }
 };
 
-class Renderer {
+static Telemetry telemetry;
+
+// Times its scope as one run of a stage
+class StageTimer {
 private:
-    Framebuffer& framebuffer;
-    Mat4 projectionMatrix;
-    
-    // Convert NDC coordinates to screen space
-    void ndcToScreen(const Vec3& ndc, int& x, int& y, float& depth) {
-        x = (int)((ndc.x + 1.0f) * 0.5f * framebuffer.getWidth());
-        y = (int)((1.0f - ndc.y) * 0.5f * framebuffer.getHeight());
-        depth = ndc.z;
+    Stage stage;
+    int frame;
+    int64_t start;
+
+public:
+    StageTimer(Stage stage, int frame = -1) : stage(stage), frame(frame), start(telemetry.now()) {}
+    ~StageTimer() { stop(); }
+
+    // End the stage before the scope does
+    void stop() {
+        if (start < 0) return;
+        telemetry.record(stage, frame, start, telemetry.now());
+        start = -1;
     }
-    
-    // Draw a line using Bresenham's algorithm
-    void drawLine(Vec3 p0, Vec3 p1, const Color& color) {
-        int x0, y0, x1, y1;
-        float d0, d1;
-        ndcToScreen(p0, x0, y0, d0);
-        ndcToScreen(p1, x1, y1, d1);
-        
-        int dx = std::abs(x1 - x0);
-        int dy = std::abs(y1 - y0);
-        int sx = (x0 < x1) ? 1 : -1;
-        int sy = (y0 < y1) ? 1 : -1;
-        int err = dx - dy;
-        
-        while (true) {
-            float t = (dx + dy == 0) ? 0.5f : (float)std::abs(x0 - x0) / (float)(dx + dy);
-            float depth = d0 + t * (d1 - d0);
-            framebuffer.setPixel(x0, y0, depth, color);
-            
-            if (x0 == x1 && y0 == y1) break;
-            
-            int e2 = 2 * err;
-            if (e2 > -dy) { err -= dy; x0 += sx; }
-            if (e2 < dx) { err += dx; y0 += sy; }
+
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+};
+
+// ============================================================================
+// Thread Pool
+// ============================================================================
+
+// Work-stealing pool: each worker owns a deque, pops from its front and
+// steals from the back of the others when it runs dry. The thread calling
+// parallelFor() helps out until its batch is done, so nested or concurrent
+// batches never deadlock.
+class ThreadPool {
+private:
+    struct Batch {
+        const std::function<void(int)>* fn;
+        std::atomic<int> remaining;
+    };
+
+    struct Task {
+        Batch* batch;
+        int index;
+    };
+
+    struct WorkerQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    std::atomic<int> pending;
+    bool stopping;
+
+    bool popFront(int q, Task& task) {
+        WorkerQueue& queue = *queues[q];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) return false;
+        task = queue.tasks.front();
+        queue.tasks.pop_front();
+        pending.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    bool popBack(int q, Task& task) {
+        WorkerQueue& queue = *queues[q];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) return false;
+        task = queue.tasks.back();
+        queue.tasks.pop_back();
+        pending.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Own queue first, then steal round-robin from the others
+    bool findTask(int self, Task& task) {
+        int count = (int)queues.size();
+        if (popFront(self, task)) return true;
+        for (int i = 1; i < count; i++) {
+            if (popBack((self + i) % count, task)) return true;
         }
+        return false;
     }
-    
-    // Fill triangle using barycentric coordinates
-    void fillTriangle(Vec3 p0, Vec3 p1, Vec3 p2, const Color& color) {
-        int x0, y0, x1, y1, x2, y2;
-        float d0, d1, d2;
-        ndcToScreen(p0, x0, y0, d0);
-        ndcToScreen(p1, x1, y1, d1);
-        ndcToScreen(p2, x2, y2, d2);
-        
-        // Bounding box
-        int minX = std::max(0, std::min({x0, x1, x2}));
-        int maxX = std::min(framebuffer.getWidth() - 1, std::max({x0, x1, x2}));
-        int minY = std::max(0, std::min({y0, y1, y2}));
-        int maxY = std::min(framebuffer.getHeight() - 1, std::max({y0, y1, y2}));
-        
-        // Rasterize
-        for (int y = minY; y <= maxY; y++) {
-            for (int x = minX; x <= maxX; x++) {
-                // Barycentric coordinates
-                float w0 = (float)((x1 - x0) * (y - y0) - (y1 - y0) * (x - x0));
-                float w1 = (float)((x2 - x1) * (y - y1) - (y2 - y1) * (x - x1));
-                float w2 = (float)((x0 - x2) * (y - y2) - (y0 - y2) * (x - x2));
-                
-                if ((w0 >= 0 && w1 >= 0 && w2 >= 0) || (w0 <= 0 && w1 <= 0 && w2 <= 0)) {
-                    float area = w0 + w1 + w2;
-                    if (area != 0) {
-                        w0 /= area;
-                        w1 /= area;
-                        w2 /= area;
-                        float depth = d0 * w0 + d1 * w1 + d2 * w2;
-                        framebuffer.setPixel(x, y, depth, color);
-                    }
-                }
+
+    static void runTask(const Task& task) {
+        (*task.batch->fn)(task.index);
+        task.batch->remaining.fetch_sub(1, std::memory_order_release);
+    }
+
+    void workerLoop(int self) {
+        while (true) {
+            Task task;
+            if (findTask(self, task)) {
+                runTask(task);
+                continue;
             }
+
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            wake.wait(lock, [this] { return stopping || pending.load() > 0; });
+            if (stopping && pending.load() == 0) return;
         }
     }
-    
+
 public:
-    Renderer(Framebuffer& fb) : framebuffer(fb) {
-        float fov = 60.0f * PI / 180.0f;
-        float aspect = (float)WIDTH / (float)HEIGHT;
-        projectionMatrix = Mat4::perspective(fov, aspect, 0.1f, 100.0f);
+    explicit ThreadPool(int threads = defaultThreadCount()) : pending(0), stopping(false) {
+        // The calling thread counts as one of the threads
+        int workerCount = std::max(0, threads - 1);
+        for (int i = 0; i < workerCount; i++) {
+            queues.push_back(std::make_unique<WorkerQueue>());
+        }
+        for (int i = 0; i < workerCount; i++) {
+            workers.emplace_back(&ThreadPool::workerLoop, this, i);
+        }
     }
-    
-    void drawTriangle(Vec3 v0, Vec3 v1, Vec3 v2, const Mat4& mvp, const Color& color, bool filled = true) {
-        // Transform vertices
-        Vec4 p0 = mvp * Vec4(v0);
-        Vec4 p1 = mvp * Vec4(v1);
-        Vec4 p2 = mvp * Vec4(v2);
-        
-        // Perspective divide
-        Vec3 ndc0 = p0.toVec3();
-        Vec3 ndc1 = p1.toVec3();
-        Vec3 ndc2 = p2.toVec3();
-        
-        // Backface culling
-        Vec3 edge1 = ndc1 - ndc0;
-        Vec3 edge2 = ndc2 - ndc0;
-        float cross = edge1.x * edge2.y - edge1.y * edge2.x;
-        if (cross < 0) return; // Back-facing
-        
-        if (filled) {
-            fillTriangle(ndc0, ndc1, ndc2, color);
-        } else {
-            drawLine(ndc0, ndc1, color);
-            drawLine(ndc1, ndc2, color);
-            drawLine(ndc2, ndc0, color);
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
         }
+        wake.notify_all();
+        for (auto& worker : workers) worker.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    static int defaultThreadCount() {
+        unsigned int n = std::thread::hardware_concurrency();
+        return n > 0 ? (int)n : 1;
+    }
+
+    int getThreadCount() const { return (int)workers.size() + 1; }
+
+    // Run fn(0..count-1) across the pool and wait for all of them
+    void parallelFor(int count, const std::function<void(int)>& fn) {
+        if (count <= 0) return;
+        if (workers.empty() || count == 1) {
+            for (int i = 0; i < count; i++) fn(i);
+            return;
+        }
+
+        Batch batch;
+        batch.fn = &fn;
+        batch.remaining.store(count);
+
+        // Hand out contiguous runs so neighbouring tasks start on one worker
+        int queueCount = (int)queues.size();
+        for (int q = 0; q < queueCount; q++) {
+            int begin = (int)((long long)count * q / queueCount);
+            int end = (int)((long long)count * (q + 1) / queueCount);
+            std::lock_guard<std::mutex> lock(queues[q]->mutex);
+            for (int i = begin; i < end; i++) {
+                queues[q]->tasks.push_back(Task{&batch, i});
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            pending.fetch_add(count);
+        }
+        wake.notify_all();
+
+        // Help until our own batch has drained
+        int cursor = 0;
+        while (batch.remaining.load(std::memory_order_acquire) > 0) {
+            Task task;
+            if (findTask(cursor, task)) {
+                runTask(task);
+            } else {
+                std::this_thread::yield();
+            }
+            cursor = (cursor + 1) % queueCount;
+        }
+    }
+};
+
+// Bounded lock-free queue for exactly one producer and one consumer thread.
+// push() and pop() wait while the queue is full or empty, which is what
+// gives pipeline stages their backpressure.
+template <typename T>
+class SpscQueue {
+private:
+    std::vector<T> slots;
+    alignas(64) std::atomic<size_t> head;   // Next slot to pop, owned by the consumer
+    alignas(64) std::atomic<size_t> tail;   // Next slot to push, owned by the producer
+
+public:
+    explicit SpscQueue(size_t capacity) : slots(capacity + 1), head(0), tail(0) {}
+
+    bool tryPush(const T& value) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t next = (t + 1) % slots.size();
+        if (next == head.load(std::memory_order_acquire)) return false;
+        slots[t] = value;
+        tail.store(next, std::memory_order_release);
+        return true;
+    }
+
+    bool tryPop(T& value) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) return false;
+        value = slots[h];
+        head.store((h + 1) % slots.size(), std::memory_order_release);
+        return true;
+    }
+
+    void push(const T& value) {
+        while (!tryPush(value)) std::this_thread::yield();
+    }
+
+    T pop() {
+        T value;
+        while (!tryPop(value)) std::this_thread::yield();
+        return value;
     }
-    
-    Mat4 getProjectionMatrix() const { return projectionMatrix; }
 };
 
 // ============================================================================
-// Phone Definition
+// Color Conversion
 // ============================================================================
 
-struct Phone {
-    std::vector<Vec3> vertices;
-    std::vector<std::vector<int>> faces;
-    std::vector<Color> faceColors;
-    
-    Phone(float width = 1.0f, float height = 2.0f, float thickness = 0.15f) {
-        // Simple iPhone-like proportions (1:2 ratio like the SVG)
-        float w = width / 2.0f;   // Half width  
-        float h = height / 2.0f;  // Half height
-        float t = thickness / 2.0f; // Half thickness
-        
-        // Colors matching the SVG exactly
-        Color frameColor(45, 55, 72);        // #2D3748 - Phone frame
-        Color screenColor(26, 32, 44);       // #1A202C - Screen area
-        Color edgeColor(74, 85, 104);        // Edges/sides
-        Color cameraColor(113, 128, 150);    // Camera
-        
-        vertices.clear();
-        faces.clear();
-        faceColors.clear();
-        
-        // Create a simple rectangular phone (8 vertices for a box)
-        // Front face vertices (screen side - Z = +t)
-        vertices.push_back(Vec3(-w, -h, t));  // 0: bottom-left front
-        vertices.push_back(Vec3( w, -h, t));  // 1: bottom-right front
-        vertices.push_back(Vec3( w,  h, t));  // 2: top-right front
-        vertices.push_back(Vec3(-w,  h, t));  // 3: top-left front
-        
-        // Back face vertices (Z = -t)
-        vertices.push_back(Vec3(-w, -h, -t)); // 4: bottom-left back
-        vertices.push_back(Vec3( w, -h, -t)); // 5: bottom-right back
-        vertices.push_back(Vec3( w,  h, -t)); // 6: top-right back
-        vertices.push_back(Vec3(-w,  h, -t)); // 7: top-left back
-        
-        // Define the 6 faces of the rectangular phone (12 triangles total)
-        
-        // Front face (screen) - 2 triangles
-        faces.push_back({0, 1, 2}); faceColors.push_back(screenColor);
-        faces.push_back({0, 2, 3}); faceColors.push_back(screenColor);
-        
-        // Back face - 2 triangles (note: reverse winding for outward normal)
-        faces.push_back({4, 6, 5}); faceColors.push_back(frameColor);
-        faces.push_back({4, 7, 6}); faceColors.push_back(frameColor);
-        
-        // Bottom face - 2 triangles
-        faces.push_back({0, 4, 5}); faceColors.push_back(edgeColor);
-        faces.push_back({0, 5, 1}); faceColors.push_back(edgeColor);
-        
-        // Top face - 2 triangles
-        faces.push_back({2, 6, 7}); faceColors.push_back(edgeColor);
-        faces.push_back({2, 7, 3}); faceColors.push_back(edgeColor);
-        
-        // Left face - 2 triangles
-        faces.push_back({0, 3, 7}); faceColors.push_back(edgeColor);
-        faces.push_back({0, 7, 4}); faceColors.push_back(edgeColor);
-        
-        // Right face - 2 triangles
-        faces.push_back({1, 5, 6}); faceColors.push_back(edgeColor);
-        faces.push_back({1, 6, 2}); faceColors.push_back(edgeColor);
-        
-        // Add small camera bump on back
-        float camX = w * 0.7f;      // Position on back
-        float camY = h * 0.7f;
-        float camSize = 0.08f;
-        float camHeight = 0.03f;
-        
-        // Camera vertices (simple square bump)
-        int camBase = vertices.size();
-        vertices.push_back(Vec3(camX - camSize, camY - camSize, -t - camHeight)); // 8
-        vertices.push_back(Vec3(camX + camSize, camY - camSize, -t - camHeight)); // 9
-        vertices.push_back(Vec3(camX + camSize, camY + camSize, -t - camHeight)); // 10
-        vertices.push_back(Vec3(camX - camSize, camY + camSize, -t - camHeight)); // 11
-        
-        // Camera faces (just the front face of the bump)
-        faces.push_back({camBase, camBase + 1, camBase + 2}); faceColors.push_back(cameraColor);
-        faces.push_back({camBase, camBase + 2, camBase + 3}); faceColors.push_back(cameraColor);
+enum ColorMatrix { COLOR_MATRIX_BT601, COLOR_MATRIX_BT709 };
+
+// 8-bit fixed-point RGB -> limited-range YCbCr weights
+struct YuvCoefficients {
+    int yr, yg, yb;
+    int ur, ug, ub;
+    int vr, vg, vb;
+};
+
+static const YuvCoefficients& yuvCoefficients(ColorMatrix matrix) {
+    static const YuvCoefficients bt601 = { 66, 129,  25, -38, -74, 112, 112,  -94, -18 };
+    static const YuvCoefficients bt709 = { 47, 157,  16, -26, -87, 112, 112, -102, -10 };
+    return matrix == COLOR_MATRIX_BT709 ? bt709 : bt601;
+}
+
+// Offsets fold the +16 / +128 bias and rounding into one positive constant,
+// so the shifts below never see a negative value
+static const int LUMA_BIAS = (16 << 8) + 128;
+static const int CHROMA_BIAS = (128 << 8) + 128;
+
+// Convert two RGBA rows into two luma rows and one row of 2x2-averaged chroma,
+// starting at pixel x. An odd trailing column is paired with itself.
+static void convertRowPairScalar(const uint8_t* rgba0, const uint8_t* rgba1, uint8_t* y0, uint8_t* y1,
+                                 uint8_t* u, uint8_t* v, int x, int width, const YuvCoefficients& k) {
+    for (; x < width; x += 2) {
+        int x1 = std::min(x + 1, width - 1);
+        const uint8_t* p[4] = { rgba0 + x * 4, rgba0 + x1 * 4, rgba1 + x * 4, rgba1 + x1 * 4 };
+
+        y0[x] = (uint8_t)((k.yr * p[0][0] + k.yg * p[0][1] + k.yb * p[0][2] + LUMA_BIAS) >> 8);
+        y1[x] = (uint8_t)((k.yr * p[2][0] + k.yg * p[2][1] + k.yb * p[2][2] + LUMA_BIAS) >> 8);
+        if (x1 != x) {
+            y0[x1] = (uint8_t)((k.yr * p[1][0] + k.yg * p[1][1] + k.yb * p[1][2] + LUMA_BIAS) >> 8);
+            y1[x1] = (uint8_t)((k.yr * p[3][0] + k.yg * p[3][1] + k.yb * p[3][2] + LUMA_BIAS) >> 8);
+        }
+
+        int r = (p[0][0] + p[1][0] + p[2][0] + p[3][0] + 2) >> 2;
+        int g = (p[0][1] + p[1][1] + p[2][1] + p[3][1] + 2) >> 2;
+        int b = (p[0][2] + p[1][2] + p[2][2] + p[3][2] + 2) >> 2;
+        u[x / 2] = (uint8_t)((k.ur * r + k.ug * g + k.ub * b + CHROMA_BIAS) >> 8);
+        v[x / 2] = (uint8_t)((k.vr * r + k.vg * g + k.vb * b + CHROMA_BIAS) >> 8);
     }
-    
-    void render(Renderer& renderer, const Mat4& modelMatrix, bool wireframe = false) {
-        Mat4 mvp = renderer.getProjectionMatrix() * modelMatrix;
-        
-        for (size_t i = 0; i < faces.size(); i++) {
-            const auto& face = faces[i];
-            if (face.size() >= 3) {
-                renderer.drawTriangle(
-                    vertices[face[0]],
-                    vertices[face[1]],
-                    vertices[face[2]],
-                    mvp,
-                    faceColors[i],
-                    !wireframe
-                );
+}
+
+typedef void (*RowPairConverter)(const uint8_t* rgba0, const uint8_t* rgba1, uint8_t* y0, uint8_t* y1,
+                                 uint8_t* u, uint8_t* v, int width, const YuvCoefficients& k);
+
+// Row pair converters are instantiated for the widths we ship, where the
+// row loop has a constant trip count and no tail; FixedWidth 0 takes the
+// width at run time
+template <int FixedWidth>
+static void convertRowPairGeneric(const uint8_t* rgba0, const uint8_t* rgba1, uint8_t* y0, uint8_t* y1,
+                                  uint8_t* u, uint8_t* v, int width, const YuvCoefficients& k) {
+    if (FixedWidth > 0) width = FixedWidth;
+    convertRowPairScalar(rgba0, rgba1, y0, y1, u, v, 0, width, k);
+}
+
+#ifdef HAVE_X86_SIMD
+// Two signed 16-bit weights in one 32-bit lane, low half first
+static inline int packWeights(int lo, int hi) {
+    return (int)(((uint32_t)(hi & 0xFFFF) << 16) | (uint32_t)(lo & 0xFFFF));
+}
+
+// Per-pixel weighted sum of 8 RGBA pixels: (r,b) and (g,a) are split into
+// 16-bit pairs and multiplied with madd, giving one 32-bit sum per pixel
+__attribute__((target("avx2")))
+static inline __m256i weightedSum(__m256i rb, __m256i ga, __m256i wRB, __m256i wG, __m256i bias) {
+    return _mm256_srli_epi32(_mm256_add_epi32(_mm256_add_epi32(_mm256_madd_epi16(rb, wRB),
+                                                               _mm256_madd_epi16(ga, wG)), bias), 8);
+}
+
+__attribute__((target("avx2")))
+static inline __m128i packLuma(__m256i lo, __m256i hi) {
+    __m256i words = _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi), 0xD8);
+    return _mm_packus_epi16(_mm256_castsi256_si128(words), _mm256_extracti128_si256(words, 1));
+}
+
+// Average each horizontal pixel pair of a vertically summed (r,b)/(g,a)
+// vector; the result sits in the even 32-bit lanes
+__attribute__((target("avx2")))
+static inline __m256i pairAverage(__m256i sum) {
+    __m256i pairs = _mm256_add_epi16(sum, _mm256_srli_epi64(sum, 32));
+    return _mm256_srli_epi16(_mm256_add_epi16(pairs, _mm256_set1_epi16(2)), 2);
+}
+
+__attribute__((target("avx2")))
+static inline __m128i packChroma(__m256i lo, __m256i hi) {
+    const __m256i evens = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+    __m128i a = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(lo, evens));
+    __m128i b = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(hi, evens));
+    return _mm_packus_epi16(_mm_packus_epi32(a, b), _mm_setzero_si128());
+}
+
+// 16 pixels per iteration: 2 x 16 luma and 8 chroma samples. Integer math
+// matches convertRowPairScalar exactly.
+template <int FixedWidth>
+__attribute__((target("avx2")))
+static void convertRowPairAVX2(const uint8_t* rgba0, const uint8_t* rgba1, uint8_t* y0, uint8_t* y1,
+                               uint8_t* u, uint8_t* v, int width, const YuvCoefficients& k) {
+    if (FixedWidth > 0) width = FixedWidth;
+    const __m256i lowBytes = _mm256_set1_epi32(0x00FF00FF);
+    const __m256i yRB = _mm256_set1_epi32(packWeights(k.yr, k.yb)), yG = _mm256_set1_epi32(packWeights(k.yg, 0));
+    const __m256i uRB = _mm256_set1_epi32(packWeights(k.ur, k.ub)), uG = _mm256_set1_epi32(packWeights(k.ug, 0));
+    const __m256i vRB = _mm256_set1_epi32(packWeights(k.vr, k.vb)), vG = _mm256_set1_epi32(packWeights(k.vg, 0));
+    const __m256i lumaBias = _mm256_set1_epi32(LUMA_BIAS), chromaBias = _mm256_set1_epi32(CHROMA_BIAS);
+
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m256i rb[4], ga[4];
+        const uint8_t* src[4] = { rgba0 + x * 4, rgba0 + x * 4 + 32, rgba1 + x * 4, rgba1 + x * 4 + 32 };
+        for (int i = 0; i < 4; i++) {
+            __m256i px = _mm256_loadu_si256((const __m256i*)src[i]);
+            rb[i] = _mm256_and_si256(px, lowBytes);
+            ga[i] = _mm256_and_si256(_mm256_srli_epi32(px, 8), lowBytes);
+        }
+
+        _mm_storeu_si128((__m128i*)(y0 + x), packLuma(weightedSum(rb[0], ga[0], yRB, yG, lumaBias),
+                                                      weightedSum(rb[1], ga[1], yRB, yG, lumaBias)));
+        _mm_storeu_si128((__m128i*)(y1 + x), packLuma(weightedSum(rb[2], ga[2], yRB, yG, lumaBias),
+                                                      weightedSum(rb[3], ga[3], yRB, yG, lumaBias)));
+
+        __m256i rbLo = pairAverage(_mm256_add_epi16(rb[0], rb[2]));
+        __m256i gaLo = pairAverage(_mm256_add_epi16(ga[0], ga[2]));
+        __m256i rbHi = pairAverage(_mm256_add_epi16(rb[1], rb[3]));
+        __m256i gaHi = pairAverage(_mm256_add_epi16(ga[1], ga[3]));
+
+        _mm_storel_epi64((__m128i*)(u + x / 2), packChroma(weightedSum(rbLo, gaLo, uRB, uG, chromaBias),
+                                                           weightedSum(rbHi, gaHi, uRB, uG, chromaBias)));
+        _mm_storel_epi64((__m128i*)(v + x / 2), packChroma(weightedSum(rbLo, gaLo, vRB, vG, chromaBias),
+                                                           weightedSum(rbHi, gaHi, vRB, vG, chromaBias)));
+    }
+
+    if (FixedWidth == 0 || FixedWidth % 16 != 0) convertRowPairScalar(rgba0, rgba1, y0, y1, u, v, x, width, k);
+}
+#endif
+
+static bool cpuHasAVX2() {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+}
+
+static const bool rowPairUseAVX2 = cpuHasAVX2();
+
+template <int FixedWidth>
+static RowPairConverter rowPairConverterFor() {
+#ifdef HAVE_X86_SIMD
+    if (rowPairUseAVX2) return convertRowPairAVX2<FixedWidth>;
+#endif
+    return convertRowPairGeneric<FixedWidth>;
+}
+
+// 720p, 1080p and 4K rows, or any other width
+static RowPairConverter selectRowPairConverter(int width) {
+    switch (width) {
+        case 1280: return rowPairConverterFor<1280>();
+        case 1920: return rowPairConverterFor<1920>();
+        case 3840: return rowPairConverterFor<3840>();
+        default:   return rowPairConverterFor<0>();
+    }
+}
+
+// Multithreaded RGBA -> YUV420P, an alternative to the swscale path. Row
+// pairs are split into bands so each task writes whole chroma rows.
+class YuvConverter {
+private:
+    ColorMatrix matrix;
+    ThreadPool* pool;
+
+    static const int BAND_ROW_PAIRS = 16;
+
+public:
+    YuvConverter(ColorMatrix matrix = COLOR_MATRIX_BT601, ThreadPool* pool = nullptr)
+        : matrix(matrix), pool(pool) {}
+
+    void convert(const uint8_t* rgba, int rgbaStride, int width, int height,
+                 uint8_t* const planes[3], const int linesize[3]) const {
+        const YuvCoefficients& k = yuvCoefficients(matrix);
+        int rowPairs = (height + 1) / 2;
+        int bands = (rowPairs + BAND_ROW_PAIRS - 1) / BAND_ROW_PAIRS;
+        RowPairConverter rowPairConverter = selectRowPairConverter(width);
+
+        auto convertBand = [&](int band) {
+            int end = std::min(rowPairs, (band + 1) * BAND_ROW_PAIRS);
+            for (int pair = band * BAND_ROW_PAIRS; pair < end; pair++) {
+                int row0 = pair * 2;
+                int row1 = std::min(row0 + 1, height - 1);
+                // A trailing odd row is converted twice into the same luma row
+                rowPairConverter(rgba + (size_t)row0 * rgbaStride, rgba + (size_t)row1 * rgbaStride,
+                                 planes[0] + (size_t)row0 * linesize[0], planes[0] + (size_t)row1 * linesize[0],
+                                 planes[1] + (size_t)pair * linesize[1], planes[2] + (size_t)pair * linesize[2],
+                                 width, k);
             }
+        };
+
+        if (pool) {
+            pool->parallelFor(bands, convertBand);
+        } else {
+            for (int band = 0; band < bands; band++) convertBand(band);
         }
     }
 };
 
 // ============================================================================
-// Video Encoder
+// Raster Kernels
 // ============================================================================
 
-class VideoEncoder {
-private:
-    AVFormatContext* fmtCtx;
-    AVCodecContext* codecCtx;
+// How a primitive meets the depth buffer: tested and written, tested only
+// (overlays that hide behind geometry but occlude nothing), or ignored
+enum DepthMode { DEPTH_TEST_WRITE, DEPTH_TEST, DEPTH_OFF, DEPTH_MODE_COUNT };
+
+enum FillMode { FILL_SOLID, FILL_WIREFRAME, FILL_MODE_COUNT };
+enum CullMode { CULL_BACK, CULL_FRONT, CULL_NONE, CULL_MODE_COUNT };
+
+class Texture;
+
+// Fixed-function state for one draw call. The renderer picks a specialised
+// assembly and raster path for it once per call rather than per triangle.
+struct RasterState {
+    FillMode fill = FILL_SOLID;
+    CullMode cull = CULL_BACK;
+    DepthMode depth = DEPTH_TEST_WRITE;
+    const Texture* texture = nullptr;   // Sampled by the mesh's textured faces when solid; must outlive flush()
+};
+
+// One triangle clipped to a rectangle of tile-local storage. Edge functions
+// are w = a*x + b*y + c, already oriented so that covered pixels have all
+// three >= 0; w0..w2 hold their values at the top-left pixel. Edge i runs
+// from vertex i to vertex i+1, so it weights the opposite vertex i+2, and
+// d0..d2 hold the depths in that order.
+struct TriangleSpan {
+    int w0, w1, w2;
+    int a0, a1, a2;
+    int b0, b1, b2;
+    float d0, d1, d2;
+    float invArea;
+    uint32_t color;
+    int width, height;
+    uint32_t* colorRow;
+    float* depthRow;
+    int stride;
+};
+
+// Kernels return the number of pixels they wrote. Each is instantiated per
+// depth mode, so the per-pixel loop carries no mode checks.
+typedef int (*TriangleKernel)(const TriangleSpan& span);
+
+template <DepthMode Depth>
+static int rasterizeTriangleScalar(const TriangleSpan& span) {
+    int rowW0 = span.w0, rowW1 = span.w1, rowW2 = span.w2;
+    int written = 0;
+
+    for (int y = 0; y < span.height; y++) {
+        uint32_t* color = span.colorRow + y * span.stride;
+        float* depthRow = span.depthRow + y * span.stride;
+        int w0 = rowW0, w1 = rowW1, w2 = rowW2;
+
+        for (int x = 0; x < span.width; x++) {
+            if ((w0 | w1 | w2) >= 0) {
+                float depth = (span.d0 * (float)w0 + span.d1 * (float)w1 + span.d2 * (float)w2) * span.invArea;
+                if (Depth == DEPTH_OFF || depth < depthRow[x]) {
+                    if (Depth == DEPTH_TEST_WRITE) depthRow[x] = depth;
+                    color[x] = span.color;
+                    written++;
+                }
+            }
+            w0 += span.a0; w1 += span.a1; w2 += span.a2;
+        }
+
+        rowW0 += span.b0; rowW1 += span.b1; rowW2 += span.b2;
+    }
+    return written;
+}
+
+#ifdef HAVE_X86_SIMD
+template <DepthMode Depth>
+__attribute__((target("sse4.1")))
+static int rasterizeTriangleSSE41(const TriangleSpan& span) {
+    const __m128i lane = _mm_setr_epi32(0, 1, 2, 3);
+    const __m128i a0 = _mm_set1_epi32(span.a0), a1 = _mm_set1_epi32(span.a1), a2 = _mm_set1_epi32(span.a2);
+    const __m128i step0 = _mm_set1_epi32(span.a0 * 4), step1 = _mm_set1_epi32(span.a1 * 4), step2 = _mm_set1_epi32(span.a2 * 4);
+    const __m128 d0 = _mm_set1_ps(span.d0), d1 = _mm_set1_ps(span.d1), d2 = _mm_set1_ps(span.d2);
+    const __m128 invArea = _mm_set1_ps(span.invArea);
+    const __m128i color = _mm_set1_epi32((int)span.color);
+    const __m128i minusOne = _mm_set1_epi32(-1);
+    int rowW0 = span.w0, rowW1 = span.w1, rowW2 = span.w2;
+    int written = 0;
+
+    for (int y = 0; y < span.height; y++) {
+        uint32_t* colorRow = span.colorRow + y * span.stride;
+        float* depthRow = span.depthRow + y * span.stride;
+        __m128i w0 = _mm_add_epi32(_mm_set1_epi32(rowW0), _mm_mullo_epi32(lane, a0));
+        __m128i w1 = _mm_add_epi32(_mm_set1_epi32(rowW1), _mm_mullo_epi32(lane, a1));
+        __m128i w2 = _mm_add_epi32(_mm_set1_epi32(rowW2), _mm_mullo_epi32(lane, a2));
+
+        for (int x = 0; x < span.width; x += 4) {
+            __m128i inside = _mm_cmpgt_epi32(_mm_or_si128(_mm_or_si128(w0, w1), w2), minusOne);
+            __m128i inRange = _mm_cmpgt_epi32(_mm_set1_epi32(span.width - x), lane);
+            inside = _mm_and_si128(inside, inRange);
+
+            if (_mm_movemask_epi8(inside)) {
+                __m128 depth = _mm_add_ps(_mm_add_ps(_mm_mul_ps(d0, _mm_cvtepi32_ps(w0)),
+                                                     _mm_mul_ps(d1, _mm_cvtepi32_ps(w1))),
+                                          _mm_mul_ps(d2, _mm_cvtepi32_ps(w2)));
+                depth = _mm_mul_ps(depth, invArea);
+
+                // Tile storage is padded to a multiple of the vector width,
+                // so the full-width read-modify-write never leaves the tile
+                __m128 oldDepth = _mm_loadu_ps(depthRow + x);
+                __m128 pass = _mm_castsi128_ps(inside);
+                if (Depth != DEPTH_OFF) pass = _mm_and_ps(_mm_cmplt_ps(depth, oldDepth), pass);
+                if (Depth == DEPTH_TEST_WRITE) _mm_storeu_ps(depthRow + x, _mm_blendv_ps(oldDepth, depth, pass));
+
+                __m128i oldColor = _mm_loadu_si128((const __m128i*)(colorRow + x));
+                _mm_storeu_si128((__m128i*)(colorRow + x), _mm_blendv_epi8(oldColor, color, _mm_castps_si128(pass)));
+                written += __builtin_popcount(_mm_movemask_ps(pass));
+            }
+
+            w0 = _mm_add_epi32(w0, step0);
+            w1 = _mm_add_epi32(w1, step1);
+            w2 = _mm_add_epi32(w2, step2);
+        }
+
+        rowW0 += span.b0; rowW1 += span.b1; rowW2 += span.b2;
+    }
+    return written;
+}
+
+template <DepthMode Depth>
+__attribute__((target("avx2")))
+static int rasterizeTriangleAVX2(const TriangleSpan& span) {
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i a0 = _mm256_set1_epi32(span.a0), a1 = _mm256_set1_epi32(span.a1), a2 = _mm256_set1_epi32(span.a2);
+    const __m256i step0 = _mm256_set1_epi32(span.a0 * 8), step1 = _mm256_set1_epi32(span.a1 * 8), step2 = _mm256_set1_epi32(span.a2 * 8);
+    const __m256 d0 = _mm256_set1_ps(span.d0), d1 = _mm256_set1_ps(span.d1), d2 = _mm256_set1_ps(span.d2);
+    const __m256 invArea = _mm256_set1_ps(span.invArea);
+    const __m256i color = _mm256_set1_epi32((int)span.color);
+    const __m256i minusOne = _mm256_set1_epi32(-1);
+    int rowW0 = span.w0, rowW1 = span.w1, rowW2 = span.w2;
+    int written = 0;
+
+    for (int y = 0; y < span.height; y++) {
+        int* colorRow = (int*)(span.colorRow + y * span.stride);
+        float* depthRow = span.depthRow + y * span.stride;
+        __m256i w0 = _mm256_add_epi32(_mm256_set1_epi32(rowW0), _mm256_mullo_epi32(lane, a0));
+        __m256i w1 = _mm256_add_epi32(_mm256_set1_epi32(rowW1), _mm256_mullo_epi32(lane, a1));
+        __m256i w2 = _mm256_add_epi32(_mm256_set1_epi32(rowW2), _mm256_mullo_epi32(lane, a2));
+
+        for (int x = 0; x < span.width; x += 8) {
+            __m256i inside = _mm256_cmpgt_epi32(_mm256_or_si256(_mm256_or_si256(w0, w1), w2), minusOne);
+            __m256i inRange = _mm256_cmpgt_epi32(_mm256_set1_epi32(span.width - x), lane);
+            inside = _mm256_and_si256(inside, inRange);
+
+            if (_mm256_movemask_epi8(inside)) {
+                __m256 depth = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(d0, _mm256_cvtepi32_ps(w0)),
+                                                           _mm256_mul_ps(d1, _mm256_cvtepi32_ps(w1))),
+                                             _mm256_mul_ps(d2, _mm256_cvtepi32_ps(w2)));
+                depth = _mm256_mul_ps(depth, invArea);
+
+                __m256i pass = inside;
+                if (Depth != DEPTH_OFF) {
+                    __m256 oldDepth = _mm256_maskload_ps(depthRow + x, inside);
+                    pass = _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(depth, oldDepth, _CMP_LT_OQ)), inside);
+                }
+                if (Depth == DEPTH_TEST_WRITE) _mm256_maskstore_ps(depthRow + x, pass, depth);
+                _mm256_maskstore_epi32(colorRow + x, pass, color);
+                written += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(pass)));
+            }
+
+            w0 = _mm256_add_epi32(w0, step0);
+            w1 = _mm256_add_epi32(w1, step1);
+            w2 = _mm256_add_epi32(w2, step2);
+        }
+
+        rowW0 += span.b0; rowW1 += span.b1; rowW2 += span.b2;
+    }
+    return written;
+}
+#endif
+
+// Pick the widest kernel the CPU supports, once per depth mode
+template <DepthMode Depth>
+static TriangleKernel selectTriangleKernel() {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return rasterizeTriangleAVX2<Depth>;
+    if (__builtin_cpu_supports("sse4.1")) return rasterizeTriangleSSE41<Depth>;
+#endif
+    return rasterizeTriangleScalar<Depth>;
+}
+
+static const TriangleKernel triangleKernels[DEPTH_MODE_COUNT] = {
+    selectTriangleKernel<DEPTH_TEST_WRITE>(), selectTriangleKernel<DEPTH_TEST>(), selectTriangleKernel<DEPTH_OFF>()
+};
+
+static const TriangleKernel triangleKernel = triangleKernels[DEPTH_TEST_WRITE];
+
+static const char* triangleKernelName(TriangleKernel kernel) {
+#ifdef HAVE_X86_SIMD
+    if (kernel == rasterizeTriangleAVX2<DEPTH_TEST_WRITE>) return "AVX2";
+    if (kernel == rasterizeTriangleSSE41<DEPTH_TEST_WRITE>) return "SSE4.1";
+#endif
+    (void)kernel;
+    return "scalar";
+}
+
+// Clip-space outcodes. The view bits mark vertices outside the visible
+// volume's sides; a triangle with all three outside the same side is
+// rejected whole. Triangles are only clipped against the near and far
+// planes and a guard band well outside the viewport, so ordinary
+// off-screen parts are left to the tile binning.
+enum ClipCode {
+    CLIP_LEFT = 1, CLIP_RIGHT = 2, CLIP_BOTTOM = 4, CLIP_TOP = 8,
+    CLIP_NEAR = 16, CLIP_FAR = 32,
+    CLIP_GUARD_LEFT = 64, CLIP_GUARD_RIGHT = 128, CLIP_GUARD_BOTTOM = 256, CLIP_GUARD_TOP = 512
+};
+
+static const int CLIP_REJECT_MASK = CLIP_LEFT | CLIP_RIGHT | CLIP_BOTTOM | CLIP_TOP | CLIP_NEAR | CLIP_FAR;
+static const int CLIP_PLANE_MASK = CLIP_NEAR | CLIP_FAR | CLIP_GUARD_LEFT | CLIP_GUARD_RIGHT |
+                                   CLIP_GUARD_BOTTOM | CLIP_GUARD_TOP;
+
+// Guard band half-width in NDC units. Keeps screen coordinates within a few
+// viewports of the screen, far from overflowing the edge function setup.
+static const float GUARD_BAND = 4.0f;
+
+// Largest output side. Edge functions are 32-bit: with vertices anywhere in
+// the guard band they reach about 20*W*H at span starts, which stays below
+// INT_MAX up to 8192x8192.
+static const int MAX_FRAME_SIZE = 8192;
+
+static inline int clipCode(float x, float y, float z, float w) {
+    float guard = GUARD_BAND * w;
+    return (x < -w ? CLIP_LEFT : 0) | (x > w ? CLIP_RIGHT : 0) |
+           (y < -w ? CLIP_BOTTOM : 0) | (y > w ? CLIP_TOP : 0) |
+           (z < -w ? CLIP_NEAR : 0) | (z > w ? CLIP_FAR : 0) |
+           (x < -guard ? CLIP_GUARD_LEFT : 0) | (x > guard ? CLIP_GUARD_RIGHT : 0) |
+           (y < -guard ? CLIP_GUARD_BOTTOM : 0) | (y > guard ? CLIP_GUARD_TOP : 0);
+}
+
+// Transform a run of SoA vertex positions by an MVP matrix, perspective
+// divide and map to screen pixels, and record each vertex's clip code. Operation order matches Mat4 * Vec4,
+// Vec4::toVec3 and the renderer's NDC-to-screen mapping exactly, so meshes
+// rasterize the same as individually drawn triangles.
+struct VertexTransformBatch {
+    const float* px;
+    const float* py;
+    const float* pz;
+    float m[4][4];
+    float width, height;
+    float* ndcX;
+    float* ndcY;
+    float* depth;
+    int* screenX;
+    int* screenY;
+    uint16_t* clipCodes;
+};
+
+typedef void (*VertexTransformKernel)(const VertexTransformBatch& batch, size_t begin, size_t end);
+
+static void transformVerticesScalar(const VertexTransformBatch& batch, size_t begin, size_t end) {
+    const float (*m)[4] = batch.m;
+    for (size_t i = begin; i < end; i++) {
+        float x = batch.px[i], y = batch.py[i], z = batch.pz[i];
+        float cx = m[0][0]*x + m[0][1]*y + m[0][2]*z + m[0][3];
+        float cy = m[1][0]*x + m[1][1]*y + m[1][2]*z + m[1][3];
+        float cz = m[2][0]*x + m[2][1]*y + m[2][2]*z + m[2][3];
+        float cw = m[3][0]*x + m[3][1]*y + m[3][2]*z + m[3][3];
+        batch.clipCodes[i] = (uint16_t)clipCode(cx, cy, cz, cw);
+        if (cw != 0) { cx /= cw; cy /= cw; cz /= cw; }
+
+        batch.ndcX[i] = cx;
+        batch.ndcY[i] = cy;
+        batch.depth[i] = cz;
+        batch.screenX[i] = (int)((cx + 1.0f) * 0.5f * batch.width);
+        batch.screenY[i] = (int)((1.0f - cy) * 0.5f * batch.height);
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("avx2")))
+static void transformVerticesAVX2(const VertexTransformBatch& batch, size_t begin, size_t end) {
+    __m256 m[4][4];
+    for (int r = 0; r < 4; r++)
+        for (int c = 0; c < 4; c++)
+            m[r][c] = _mm256_set1_ps(batch.m[r][c]);
+    const __m256 one = _mm256_set1_ps(1.0f), half = _mm256_set1_ps(0.5f), zero = _mm256_setzero_ps();
+    const __m256 width = _mm256_set1_ps(batch.width), height = _mm256_set1_ps(batch.height);
+    const __m256 guardBand = _mm256_set1_ps(GUARD_BAND);
+
+    size_t i = begin;
+    for (; i + 8 <= end; i += 8) {
+        __m256 x = _mm256_loadu_ps(batch.px + i), y = _mm256_loadu_ps(batch.py + i), z = _mm256_loadu_ps(batch.pz + i);
+        __m256 c[4];
+        for (int r = 0; r < 4; r++) {
+            c[r] = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[r][0], x), _mm256_mul_ps(m[r][1], y)),
+                                               _mm256_mul_ps(m[r][2], z)), m[r][3]);
+        }
+
+        // Same tests as clipCode(), one mask per bit
+        __m256 negW = _mm256_sub_ps(zero, c[3]);
+        __m256 guard = _mm256_mul_ps(c[3], guardBand), negGuard = _mm256_sub_ps(zero, guard);
+        const __m256 outside[10] = {
+            _mm256_cmp_ps(c[0], negW, _CMP_LT_OQ), _mm256_cmp_ps(c[0], c[3], _CMP_GT_OQ),
+            _mm256_cmp_ps(c[1], negW, _CMP_LT_OQ), _mm256_cmp_ps(c[1], c[3], _CMP_GT_OQ),
+            _mm256_cmp_ps(c[2], negW, _CMP_LT_OQ), _mm256_cmp_ps(c[2], c[3], _CMP_GT_OQ),
+            _mm256_cmp_ps(c[0], negGuard, _CMP_LT_OQ), _mm256_cmp_ps(c[0], guard, _CMP_GT_OQ),
+            _mm256_cmp_ps(c[1], negGuard, _CMP_LT_OQ), _mm256_cmp_ps(c[1], guard, _CMP_GT_OQ)
+        };
+        __m256i codes = _mm256_setzero_si256();
+        for (int bit = 0; bit < 10; bit++) {
+            codes = _mm256_or_si256(codes, _mm256_and_si256(_mm256_castps_si256(outside[bit]), _mm256_set1_epi32(1 << bit)));
+        }
+        alignas(32) int32_t codeLanes[8];
+        _mm256_store_si256((__m256i*)codeLanes, codes);
+        for (int k = 0; k < 8; k++) batch.clipCodes[i + k] = (uint16_t)codeLanes[k];
+
+        // Divide only where w != 0, like Vec4::toVec3
+        __m256 divide = _mm256_cmp_ps(c[3], zero, _CMP_NEQ_UQ);
+        __m256 cx = _mm256_blendv_ps(c[0], _mm256_div_ps(c[0], c[3]), divide);
+        __m256 cy = _mm256_blendv_ps(c[1], _mm256_div_ps(c[1], c[3]), divide);
+        __m256 cz = _mm256_blendv_ps(c[2], _mm256_div_ps(c[2], c[3]), divide);
+
+        _mm256_storeu_ps(batch.ndcX + i, cx);
+        _mm256_storeu_ps(batch.ndcY + i, cy);
+        _mm256_storeu_ps(batch.depth + i, cz);
+        _mm256_storeu_si256((__m256i*)(batch.screenX + i),
+                            _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_mul_ps(_mm256_add_ps(cx, one), half), width)));
+        _mm256_storeu_si256((__m256i*)(batch.screenY + i),
+                            _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(one, cy), half), height)));
+    }
+
+    transformVerticesScalar(batch, i, end);
+}
+#endif
+
+static VertexTransformKernel selectVertexTransformKernel() {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return transformVerticesAVX2;
+#endif
+    return transformVerticesScalar;
+}
+
+static const VertexTransformKernel vertexTransformKernel = selectVertexTransformKernel();
+
+// ============================================================================
+// 3D Renderer
+// ============================================================================
+
+struct Color {
+    uint8_t r, g, b, a;
+    Color(uint8_t r, uint8_t g, uint8_t b, uint8_t a = 255) : r(r), g(g), b(b), a(a) {}
+};
+
+// Framebuffer pixels are handed to the colour converters as packed RGBA bytes
+static_assert(sizeof(Color) == 4, "Color must be tightly packed RGBA");
+
+// Half-open pixel rectangle [x0, x1) x [y0, y1)
+struct Rect {
+    int x0, y0, x1, y1;
+
+    Rect() : x0(0), y0(0), x1(0), y1(0) {}
+    Rect(int x0, int y0, int x1, int y1) : x0(x0), y0(y0), x1(x1), y1(y1) {}
+
+    bool empty() const { return x0 >= x1 || y0 >= y1; }
+
+    Rect united(const Rect& other) const {
+        if (empty()) return other;
+        if (other.empty()) return *this;
+        return Rect(std::min(x0, other.x0), std::min(y0, other.y0), std::max(x1, other.x1), std::max(y1, other.y1));
+    }
+};
+
+// RGBA keeps a packed colour per pixel for the encoder to convert. YUV420
+// renders straight into the encoder's planar frame: pixels hold an index
+// into a per-frame palette of flat colours, each converted to YUV once, and
+// luma plus 2x2-averaged chroma are resolved as tiles are written back.
+// Colours computed per pixel, like texture samples, skip the palette: the
+// upper half of the index range is a fixed RGB555 cube, see directColor().
+enum RenderTarget { RENDER_TARGET_RGBA, RENDER_TARGET_YUV420 };
+
+class Framebuffer {
+private:
+    struct PaletteEntry {
+        uint8_t y;
+        int u, v;   // Unrounded, unbiased chroma sums, averaged per 2x2 block
+    };
+
+    int width, height;
+    RenderTarget target;
+    ColorMatrix matrix;
+    std::vector<Color> pixels;
+    std::vector<uint16_t> paletteIndices;
+    std::vector<float> depthBuffer;
+    std::vector<float> blockMaxDepth;   // Upper bound on the depth in each 8x8 block
+    int blocksX;
+
+    // Outside `drawn` every buffer still holds the last clear, so the next
+    // clear only has to undo what was drawn since
+    Color background;
+    bool cleared;
+    Rect drawn;
+    Rect planesDrawn;   // Pixels of the bound YUV planes that may not be background
+
+    std::vector<PaletteEntry> palette;  // Flat colours from 0, the RGB555 cube from DIRECT_COLOR
+    uint32_t paletteSize;               // Flat colours in use this frame
+    uint32_t paletteOverflows;          // Flat colours that found the palette full, since takePaletteOverflows()
+    std::unordered_map<uint32_t, uint16_t> paletteLookup;
+    uint8_t* planes[3];
+    int linesize[3];
+
+    static uint32_t pack(const Color& color) {
+        uint32_t value;
+        std::memcpy(&value, &color, sizeof(value));
+        return value;
+    }
+
+    PaletteEntry paletteEntry(int r, int g, int b) const {
+        const YuvCoefficients& k = yuvCoefficients(matrix);
+        PaletteEntry entry;
+        entry.y = (uint8_t)((k.yr * r + k.yg * g + k.yb * b + LUMA_BIAS) >> 8);
+        entry.u = k.ur * r + k.ug * g + k.ub * b;
+        entry.v = k.vr * r + k.vg * g + k.vb * b;
+        return entry;
+    }
+
+    // Luma and chroma for the rectangle [x0, x0 + w) x [y0, y0 + h), which
+    // must start on even coordinates. A trailing odd row or column pairs with itself.
+    void resolveYuv(int x0, int y0, int w, int h) {
+        for (int y = y0; y < y0 + h; y += 2) {
+            int y1 = std::min(y + 1, height - 1);
+            const uint16_t* row0 = &paletteIndices[y * width];
+            const uint16_t* row1 = &paletteIndices[y1 * width];
+            uint8_t* luma0 = planes[0] + (size_t)y * linesize[0];
+            uint8_t* luma1 = planes[0] + (size_t)y1 * linesize[0];
+            uint8_t* u = planes[1] + (size_t)(y / 2) * linesize[1];
+            uint8_t* v = planes[2] + (size_t)(y / 2) * linesize[2];
+
+            for (int x = x0; x < x0 + w; x += 2) {
+                int x1 = std::min(x + 1, width - 1);
+                const PaletteEntry& p00 = palette[row0[x]];
+                const PaletteEntry& p01 = palette[row0[x1]];
+                const PaletteEntry& p10 = palette[row1[x]];
+                const PaletteEntry& p11 = palette[row1[x1]];
+
+                luma0[x] = p00.y; luma0[x1] = p01.y;
+                luma1[x] = p10.y; luma1[x1] = p11.y;
+                u[x / 2] = (uint8_t)((p00.u + p01.u + p10.u + p11.u + (128 << 10) + 512) >> 10);
+                v[x / 2] = (uint8_t)((p00.v + p01.v + p10.v + p11.v + (128 << 10) + 512) >> 10);
+            }
+        }
+    }
+    
+public:
+    // Granularity of the coarse depth bounds kept alongside the depth buffer
+    static const int DEPTH_BLOCK = 8;
+
+    // First YUV420 palette index of the RGB555 cube
+    static const uint32_t DIRECT_COLOR = 0x8000;
+
+    Framebuffer(int w, int h, RenderTarget target = RENDER_TARGET_RGBA, ColorMatrix matrix = COLOR_MATRIX_BT601)
+        : width(w), height(h), target(target), matrix(matrix), background(0, 0, 0), cleared(false), paletteSize(0),
+          paletteOverflows(0),
+          planes{nullptr, nullptr, nullptr}, linesize{0, 0, 0} {
+        if (target == RENDER_TARGET_RGBA) {
+            pixels.resize(w * h, Color(0, 0, 0));
+        } else {
+            paletteIndices.resize(w * h, 0);
+            palette.resize(0x10000);
+            for (uint32_t i = 0; i < DIRECT_COLOR; i++) {
+                int r = i >> 10 & 31, g = i >> 5 & 31, b = i & 31;
+                palette[DIRECT_COLOR + i] = paletteEntry(r << 3 | r >> 2, g << 3 | g >> 2, b << 3 | b >> 2);
+            }
+        }
+        depthBuffer.resize(w * h, 1.0f);
+        blocksX = (w + DEPTH_BLOCK - 1) / DEPTH_BLOCK;
+        blockMaxDepth.resize(blocksX * ((h + DEPTH_BLOCK - 1) / DEPTH_BLOCK), 1.0f);
+    }
+
+    // Point a YUV420 framebuffer at the planes it renders into. Must be
+    // called before clear() whenever the frame buffers change. `stale`
+    // bounds what in the planes may differ from the background: what was
+    // drawn when they were last rendered into, or everything if never.
+    void bindYuvTarget(uint8_t* const data[3], const int strides[3], const Rect& stale) {
+        for (int i = 0; i < 3; i++) {
+            planes[i] = data[i];
+            linesize[i] = strides[i];
+        }
+        planesDrawn = stale;
+    }
+
+    // Pixel payload for a colour: packed RGBA, or a palette index in YUV420
+    // mode. New palette colours are converted to YUV here, once per frame.
+    uint32_t encodeColor(const Color& color) {
+        if (target == RENDER_TARGET_RGBA) return pack(color);
+
+        uint32_t key = pack(color);
+        auto found = paletteLookup.find(key);
+        if (found != paletteLookup.end()) return found->second;
+
+        // Flat colours have the lower half of the 16-bit indices; past that,
+        // they take their nearest RGB555 cube entry, counted once per colour and frame
+        if (paletteSize >= DIRECT_COLOR) {
+            paletteOverflows++;
+            uint32_t payload = DIRECT_COLOR | (uint32_t)((color.r * 31 + 127) / 255) << 10 |
+                               (uint32_t)((color.g * 31 + 127) / 255) << 5 | (uint32_t)((color.b * 31 + 127) / 255);
+            paletteLookup[key] = payload;
+            return payload;
+        }
+
+        uint16_t index = (uint16_t)paletteSize++;
+        palette[index] = paletteEntry(color.r, color.g, color.b);
+        paletteLookup[key] = index;
+        return index;
+    }
+
+    // YUV420 payload for a colour computed per pixel, rather than per
+    // primitive: its RGB555 cube entry, ordered-dithered by pixel position so
+    // gradients keep their 8-bit average. Needs no palette lookup.
+    static uint32_t directColor(const Color& color, int x, int y) {
+        static const uint8_t BAYER[4][4] = {{0, 8, 2, 10}, {12, 4, 14, 6}, {3, 11, 1, 9}, {15, 7, 13, 5}};
+        int dither = BAYER[y & 3][x & 3] >> 1;
+        int r = std::min(255, color.r + dither), g = std::min(255, color.g + dither), b = std::min(255, color.b + dither);
+        return DIRECT_COLOR | (uint32_t)(r >> 3) << 10 | (uint32_t)(g >> 3) << 5 | (uint32_t)(b >> 3);
+    }
+    
+    // Only what was drawn since the last clear is cleared again. A new
+    // background repaints everything and counts as drawn, so consumers of
+    // getDrawn() redo the whole frame too.
+    void clear(const Color& color) {
+        bool full = !cleared || pack(color) != pack(background);
+        Rect region = full ? bounds() : drawn;
+        background = color;
+        cleared = true;
+        drawn = full ? bounds() : Rect();
+
+        int bx0 = region.x0 / DEPTH_BLOCK, bx1 = (region.x1 + DEPTH_BLOCK - 1) / DEPTH_BLOCK;
+        for (int by = region.y0 / DEPTH_BLOCK; by < (region.y1 + DEPTH_BLOCK - 1) / DEPTH_BLOCK; by++) {
+            std::fill(&blockMaxDepth[by * blocksX + bx0], &blockMaxDepth[by * blocksX + bx1], 1.0f);
+        }
+        for (int y = region.y0; y < region.y1; y++) {
+            int idx = y * width;
+            std::fill(&depthBuffer[idx + region.x0], &depthBuffer[idx + region.x1], 1.0f);
+            if (target == RENDER_TARGET_RGBA) {
+                std::fill(&pixels[idx + region.x0], &pixels[idx + region.x1], color);
+            } else {
+                std::fill(&paletteIndices[idx + region.x0], &paletteIndices[idx + region.x1], 0);
+            }
+        }
+        if (target == RENDER_TARGET_RGBA) return;
+
+        // Palette entry 0 is the background, written straight into the
+        // planes wherever they were last drawn, rounded out to whole chroma samples
+        paletteSize = 0;
+        paletteLookup.clear();
+        encodeColor(color);
+
+        Rect stale = full ? bounds() : planesDrawn;
+        if (stale.empty()) return;
+        int x0 = stale.x0 & ~1, x1 = std::min(width, (stale.x1 + 1) & ~1);
+        int y0 = stale.y0 & ~1, y1 = std::min(height, (stale.y1 + 1) & ~1);
+
+        const PaletteEntry& entry = palette[0];
+        uint8_t u = (uint8_t)((entry.u * 4 + (128 << 10) + 512) >> 10);
+        uint8_t v = (uint8_t)((entry.v * 4 + (128 << 10) + 512) >> 10);
+        for (int y = y0; y < y1; y++) {
+            std::memset(planes[0] + (size_t)y * linesize[0] + x0, entry.y, x1 - x0);
+        }
+        for (int y = y0 / 2; y < (y1 + 1) / 2; y++) {
+            std::memset(planes[1] + (size_t)y * linesize[1] + x0 / 2, u, (x1 - x0 + 1) / 2);
+            std::memset(planes[2] + (size_t)y * linesize[2] + x0 / 2, v, (x1 - x0 + 1) / 2);
+        }
+    }
+
+    // Extend the drawn bounds before pixels inside r are written
+    void markDrawn(const Rect& r) {
+        drawn = drawn.united(r);
+    }
+
+    
+    void setPixel(int x, int y, float depth, const Color& color) {
+        if (x < 0 || x >= width || y < 0 || y >= height) return;
+        
+        int idx = y * width + x;
+        if (depth < depthBuffer[idx]) {
+            markDrawn(Rect(x, y, x + 1, y + 1));
+            depthBuffer[idx] = depth;
+            if (target == RENDER_TARGET_RGBA) {
+                pixels[idx] = color;
+            } else {
+                paletteIndices[idx] = (uint16_t)encodeColor(color);
+                resolveYuv(x & ~1, y & ~1, 2, 2);
+            }
+        }
+    }
+    
+    // Copy a rectangle into / out of tile-local storage with the given row
+    // stride. Tiles hold the 32-bit payload from encodeColor(), and the
+    // depth bounds of their 8x8 blocks with a row stride of stride / 8.
+    // Depth only ever decreases, so bounds not updated by setPixel() or
+    // a tile's lines stay valid, if loose.
+    void loadTile(int x0, int y0, int w, int h, uint32_t* tileColor, float* tileDepth, float* tileBlockMax,
+                  int stride) const {
+        int blockStride = stride / DEPTH_BLOCK, blockRow = (w + DEPTH_BLOCK - 1) / DEPTH_BLOCK;
+        for (int by = 0; by * DEPTH_BLOCK < h; by++) {
+            std::memcpy(&tileBlockMax[by * blockStride], &blockMaxDepth[(y0 / DEPTH_BLOCK + by) * blocksX + x0 / DEPTH_BLOCK],
+                        blockRow * sizeof(float));
+        }
+        for (int row = 0; row < h; row++) {
+            int idx = (y0 + row) * width + x0;
+            if (target == RENDER_TARGET_RGBA) {
+                std::memcpy(&tileColor[row * stride], pixels.data() + idx, w * sizeof(Color));
+            } else {
+                std::copy(&paletteIndices[idx], &paletteIndices[idx] + w, &tileColor[row * stride]);
+            }
+            std::memcpy(&tileDepth[row * stride], &depthBuffer[idx], w * sizeof(float));
+        }
+    }
+
+    // Tiles start on even coordinates, so in YUV420 mode every chroma sample
+    // they touch can be resolved from the tile alone
+    void storeTile(int x0, int y0, int w, int h, const uint32_t* tileColor, const float* tileDepth,
+                   const float* tileBlockMax, int stride) {
+        int blockStride = stride / DEPTH_BLOCK, blockRow = (w + DEPTH_BLOCK - 1) / DEPTH_BLOCK;
+        for (int by = 0; by * DEPTH_BLOCK < h; by++) {
+            std::memcpy(&blockMaxDepth[(y0 / DEPTH_BLOCK + by) * blocksX + x0 / DEPTH_BLOCK], &tileBlockMax[by * blockStride],
+                        blockRow * sizeof(float));
+        }
+        for (int row = 0; row < h; row++) {
+            int idx = (y0 + row) * width + x0;
+            if (target == RENDER_TARGET_RGBA) {
+                std::memcpy((void*)(pixels.data() + idx), &tileColor[row * stride], w * sizeof(Color));
+            } else {
+                std::copy(&tileColor[row * stride], &tileColor[row * stride] + w, &paletteIndices[idx]);
+            }
+            std::memcpy(&depthBuffer[idx], &tileDepth[row * stride], w * sizeof(float));
+        }
+        if (target == RENDER_TARGET_YUV420) resolveYuv(x0, y0, w, h);
+    }
+
+    // Palette overflows since the last call, for the raster stats
+    uint32_t takePaletteOverflows() {
+        uint32_t count = paletteOverflows;
+        paletteOverflows = 0;
+        return count;
+    }
+
+    const Color* getData() const { return pixels.data(); }
+    const Rect& getDrawn() const { return drawn; }
+    Rect bounds() const { return Rect(0, 0, width, height); }
+    RenderTarget getTarget() const { return target; }
+    ColorMatrix getMatrix() const { return matrix; }
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+};
+
+// Largest power of two not above n, for n >= 1
+static int floorPowerOfTwo(int n) {
+    int p = 1;
+    while (p <= n / 2) p *= 2;
+    return p;
+}
+
+// RGBA image with a full mip chain, sides powers of two. Each level is
+// stored in Morton order, the bits of x and y interleaved, so texels close
+// in either direction are close in memory: a bilinear footprint mostly
+// shares a cache line, and triangles at any rotation walk few lines per row.
+// Levels are box-filtered, so a shrinking triangle moves to a smaller level
+// rather than striding across a large one.
+class Texture {
+private:
+    struct Level {
+        int width, height;
+        std::vector<Color> texels;
+        std::vector<uint32_t> columnBits, rowBits;  // Address = columnBits[x] | rowBits[y]
+    };
+
+    std::vector<Level> levels;
+
+    // Low bits of c spread to every other bit from `offset`, for the bits
+    // both sides have; the longer side's remaining bits sit above them all
+    static uint32_t spreadBits(uint32_t c, int shared, int offset) {
+        uint32_t bits = 0;
+        for (int i = 0; i < shared; i++) bits |= (c >> i & 1) << (2 * i + offset);
+        return bits | (c >> shared) << (2 * shared);
+    }
+
+    Color texel(const Level& level, int x, int y) const {
+        return level.texels[level.columnBits[x] | level.rowBits[y]];
+    }
+
+public:
+    // Allocate every level of a width x height texture, both powers of two
+    void create(int width, int height) {
+        levels.clear();
+        while (true) {
+            Level level;
+            level.width = width;
+            level.height = height;
+            level.texels.assign((size_t)width * height, Color(0, 0, 0));
+            int shared = 0;
+            while ((1 << shared) < std::min(width, height)) shared++;
+            level.columnBits.resize(width);
+            level.rowBits.resize(height);
+            for (int x = 0; x < width; x++) level.columnBits[x] = spreadBits(x, shared, 0);
+            for (int y = 0; y < height; y++) level.rowBits[y] = spreadBits(y, shared, 1);
+            levels.push_back(std::move(level));
+            if (width == 1 && height == 1) break;
+            width = std::max(1, width / 2);
+            height = std::max(1, height / 2);
+        }
+    }
+
+    // Swizzle RGBA rows into the top level and rebuild the rest from it
+    void upload(const uint8_t* rgba, int stride) {
+        Level& top = levels[0];
+        for (int y = 0; y < top.height; y++) {
+            const uint8_t* row = rgba + (size_t)y * stride;
+            for (int x = 0; x < top.width; x++) std::memcpy(&top.texels[top.columnBits[x] | top.rowBits[y]], row + x * 4, 4);
+        }
+
+        for (size_t i = 1; i < levels.size(); i++) {
+            const Level& src = levels[i - 1];
+            Level& dst = levels[i];
+            for (int y = 0; y < dst.height; y++) {
+                int y0 = std::min(2 * y, src.height - 1), y1 = std::min(2 * y + 1, src.height - 1);
+                for (int x = 0; x < dst.width; x++) {
+                    int x0 = std::min(2 * x, src.width - 1), x1 = std::min(2 * x + 1, src.width - 1);
+                    Color a = texel(src, x0, y0), b = texel(src, x1, y0), c = texel(src, x0, y1), d = texel(src, x1, y1);
+                    dst.texels[dst.columnBits[x] | dst.rowBits[y]] =
+                        Color((uint8_t)((a.r + b.r + c.r + d.r + 2) >> 2), (uint8_t)((a.g + b.g + c.g + d.g + 2) >> 2),
+                              (uint8_t)((a.b + b.b + c.b + d.b + 2) >> 2), (uint8_t)((a.a + b.a + c.a + d.a + 2) >> 2));
+                }
+            }
+        }
+    }
+
+    // Bilinear sample of one level at (u, v) in [0, 1], (0, 0) the top-left
+    // corner, clamped to the edges
+    Color sample(float u, float v, int levelIndex) const {
+        const Level& level = levels[levelIndex];
+        u = std::min(std::max(u, 0.0f), 1.0f);
+        v = std::min(std::max(v, 0.0f), 1.0f);
+
+        // Texel centres are at half-integers; 8 bits of weight between them
+        int fx = (int)(u * (float)(level.width * 256)) - 128, fy = (int)(v * (float)(level.height * 256)) - 128;
+        int x = fx >> 8, y = fy >> 8, wx = fx & 255, wy = fy & 255;
+        int x0 = std::max(x, 0), x1 = std::min(x + 1, level.width - 1);
+        int y0 = std::max(y, 0), y1 = std::min(y + 1, level.height - 1);
+
+        Color a = texel(level, x0, y0), b = texel(level, x1, y0), c = texel(level, x0, y1), d = texel(level, x1, y1);
+        auto blend = [wx, wy](int p00, int p10, int p01, int p11) {
+            int top = p00 * (256 - wx) + p10 * wx, bottom = p01 * (256 - wx) + p11 * wx;
+            return (uint8_t)((top * (256 - wy) + bottom * wy + 32768) >> 16);
+        };
+        return Color(blend(a.r, b.r, c.r, d.r), blend(a.g, b.g, c.g, d.g), blend(a.b, b.b, c.b, d.b),
+                     blend(a.a, b.a, c.a, d.a));
+    }
+
+    int getWidth() const { return levels.empty() ? 0 : levels[0].width; }
+    int getHeight() const { return levels.empty() ? 0 : levels[0].height; }
+    int levelCount() const { return (int)levels.size(); }
+};
+
+// An undirected mesh edge and the faces on either side of it. Edges shared
+// by more than two faces get one entry per pair.
+struct MeshEdge {
+    uint32_t v0, v1;
+    uint32_t faces[2];      // NO_FACE on the open side of a boundary edge
+};
+
+static const uint32_t NO_FACE = UINT32_MAX;
+
+// Non-owning view of an indexed mesh, either a Mesh in memory or a mapped
+// mesh file used in place
+struct MeshView {
+    const float* px;
+    const float* py;
+    const float* pz;
+    const uint32_t* indices;
+    const Color* faceColors;
+    size_t vertexCount;
+    size_t triangleCount;
+    Vec3 boundsMin, boundsMax;
+    const MeshEdge* edges;  // Optional unique edge list for wireframe, see Mesh::buildEdges
+    size_t edgeCount;
+    const float* texU;      // Optional texture coordinates, one per vertex
+    const float* texV;
+    const uint8_t* texturedFaces;   // Optional, nonzero for faces that sample the draw's texture
+};
+
+// Indexed triangle mesh. Positions are stored as separate x/y/z arrays so
+// the renderer can transform them in SIMD batches; triangles are a flat
+// index buffer with one flat colour each.
+struct Mesh {
+    std::vector<float> px, py, pz;
+    std::vector<uint32_t> indices;      // 3 per triangle
+    std::vector<Color> faceColors;      // 1 per triangle
+    std::vector<MeshEdge> edges;        // Empty until buildEdges
+    std::vector<float> texU, texV;      // Empty, or 1 per vertex
+    std::vector<uint8_t> texturedFaces; // Empty, or 1 per triangle
+
+    size_t vertexCount() const { return px.size(); }
+    size_t triangleCount() const { return faceColors.size(); }
+
+    uint32_t addVertex(const Vec3& v) {
+        px.push_back(v.x);
+        py.push_back(v.y);
+        pz.push_back(v.z);
+        return (uint32_t)(px.size() - 1);
+    }
+
+    void addTriangle(uint32_t a, uint32_t b, uint32_t c, const Color& color) {
+        indices.push_back(a);
+        indices.push_back(b);
+        indices.push_back(c);
+        faceColors.push_back(color);
+    }
+
+    // Texture coordinates for a vertex, (0, 0) the top-left of the texture
+    void setTexCoord(uint32_t vertex, float u, float v) {
+        texU.resize(vertexCount(), 0.0f);
+        texV.resize(vertexCount(), 0.0f);
+        texU[vertex] = u;
+        texV[vertex] = v;
+    }
+
+    // Have a triangle sample the draw's texture instead of its flat colour
+    void setTextured(size_t face) {
+        texturedFaces.resize(triangleCount(), 0);
+        texturedFaces[face] = 1;
+    }
+
+    // Find every edge once, so wireframe draws shared edges a single time
+    void buildEdges() {
+        struct HalfEdge {
+            uint64_t key;   // Lower vertex index in the high half
+            uint32_t face;
+            bool operator<(const HalfEdge& o) const { return key != o.key ? key < o.key : face < o.face; }
+        };
+        std::vector<HalfEdge> halves;
+        halves.reserve(indices.size());
+        for (size_t face = 0; face < triangleCount(); face++) {
+            for (int k = 0; k < 3; k++) {
+                uint32_t a = indices[face * 3 + k], b = indices[face * 3 + (k + 1) % 3];
+                if (a == b) continue;
+                halves.push_back({(uint64_t)std::min(a, b) << 32 | std::max(a, b), (uint32_t)face});
+            }
+        }
+        std::sort(halves.begin(), halves.end());
+
+        edges.clear();
+        for (size_t i = 0; i < halves.size();) {
+            MeshEdge edge = {(uint32_t)(halves[i].key >> 32), (uint32_t)halves[i].key, {halves[i].face, NO_FACE}};
+            bool paired = i + 1 < halves.size() && halves[i + 1].key == halves[i].key;
+            if (paired) edge.faces[1] = halves[i + 1].face;
+            edges.push_back(edge);
+            i += paired ? 2 : 1;
+        }
+    }
+
+    MeshView view() const {
+        MeshView v = {px.data(), py.data(), pz.data(), indices.data(), faceColors.data(),
+                      vertexCount(), triangleCount(), Vec3(), Vec3(), edges.empty() ? nullptr : edges.data(),
+                      edges.size(), texU.empty() ? nullptr : texU.data(), texU.empty() ? nullptr : texV.data(),
+                      texturedFaces.empty() ? nullptr : texturedFaces.data()};
+        if (!px.empty()) {
+            auto x = std::minmax_element(px.begin(), px.end());
+            auto y = std::minmax_element(py.begin(), py.end());
+            auto z = std::minmax_element(pz.begin(), pz.end());
+            v.boundsMin = Vec3(*x.first, *y.first, *z.first);
+            v.boundsMax = Vec3(*x.second, *y.second, *z.second);
+        }
+        return v;
+    }
+};
+
+// Rasterizer work counters summed over every renderer, to measure overdraw
+// and what the hierarchical depth test saves
+struct RasterStats {
+    std::atomic<uint64_t> frames{0}, pixels{0};         // Flushes and the framebuffer pixels they covered
+    std::atomic<uint64_t> tileTriangles{0};             // Triangle and tile pairs rasterized
+    std::atomic<uint64_t> tileTrianglesOccluded{0};     // ... rejected whole by the tile's depth bound
+    std::atomic<uint64_t> blocks{0};                    // 8x8 blocks a triangle's bounding box touched
+    std::atomic<uint64_t> blocksOccluded{0};            // ... rejected by the block's depth bound
+    std::atomic<uint64_t> blocksEmpty{0};               // ... outside the triangle entirely
+    std::atomic<uint64_t> pixelsTested{0};              // Pixels the triangle kernels evaluated
+    std::atomic<uint64_t> depthWrites{0};               // Pixels that passed the depth test
+    std::atomic<uint64_t> trianglesSubmitted{0};        // Triangles drawn, before clipping
+    std::atomic<uint64_t> trianglesCulled{0};           // Triangles or clipped pieces rejected before setup
+    std::atomic<uint64_t> trianglesRasterized{0};       // Triangles or clipped pieces set up and binned
+    std::atomic<uint64_t> paletteOverflows{0};          // YUV420 flat colours that did not fit a frame's palette
+};
+
+static RasterStats rasterStats;
+
+static void printRasterStats() {
+    uint64_t pixels = rasterStats.pixels, blocks = rasterStats.blocks, tileTriangles = rasterStats.tileTriangles;
+    if (pixels == 0) return;
+    std::cout << "Triangles: " << rasterStats.trianglesSubmitted << " submitted, " << rasterStats.trianglesCulled
+              << " culled, " << rasterStats.trianglesRasterized << " rasterized (clipped triangles count per piece)"
+              << std::endl;
+    std::cout << "Pixels: " << rasterStats.pixelsTested << " tested, " << rasterStats.depthWrites << " written"
+              << std::endl;
+    std::cout << "Overdraw: " << (double)rasterStats.depthWrites / pixels << " depth writes per pixel over "
+              << rasterStats.frames << " frames" << std::endl;
+    std::cout << "Hierarchical Z: rejected " << 100.0 * rasterStats.tileTrianglesOccluded / std::max<uint64_t>(1, tileTriangles)
+              << "% of triangle tiles and " << 100.0 * rasterStats.blocksOccluded / std::max<uint64_t>(1, blocks)
+              << "% of 8x8 blocks (" << 100.0 * rasterStats.blocksEmpty / std::max<uint64_t>(1, blocks)
+              << "% uncovered)" << std::endl;
+    if (rasterStats.paletteOverflows > 0) {
+        std::cout << "Warning: " << rasterStats.paletteOverflows
+                  << " flat colours did not fit the YUV420 palette and were rounded to RGB555" << std::endl;
+    }
+}
+
+class Renderer {
+private:
+    static const int TILE_SIZE = 64;
+    static const int DEPTH_BLOCK = Framebuffer::DEPTH_BLOCK;
+    static const int TILE_BLOCKS = TILE_SIZE / DEPTH_BLOCK;    // Depth blocks per tile row
+
+    // Screen-space triangle after transform, cull and setup
+    struct RasterPrimitive {
+        int x0, y0, x1, y1, x2, y2;
+        float d0, d1, d2;
+        int minX, maxX, minY, maxY;
+        uint32_t color;     // Framebuffer payload, see Framebuffer::encodeColor
+        int edgeA[3], edgeB[3];
+        long long edgeC[3];
+        float invArea;
+        float nearestDepth;     // Bounds on any depth the triangle produces
+        float farthestDepth;
+        DepthMode depth;
+        uint32_t texture;       // Index into textureSetups, or NO_TEXTURE for the flat colour
+    };
+
+    static const uint32_t NO_TEXTURE = UINT32_MAX;
+
+    // 1/w and u/w, v/w are affine in screen space, so a textured triangle
+    // carries them as planes over its edge functions, which interpolate
+    // them perspective-correctly. Entry i scales edge function i, the
+    // weight of vertex (i + 2) % 3.
+    struct TextureSetup {
+        const Texture* texture;
+        float q[3], uq[3], vq[3];
+        bool direct;            // Payloads are Framebuffer::directColor()
+    };
+
+    // A vertex's texture coordinates over its clip-space w, and 1/w
+    struct TexCoord {
+        float q, uq, vq;
+    };
+
+    // Screen-space line set up for a DDA: one pixel per step along the major
+    // axis from (x0, y0), the minor coordinate advancing by minorStep in
+    // 32.32 fixed point and rounded to the nearest pixel
+    struct RasterLine {
+        int x0, y0;
+        float d0, depthStep;
+        bool xMajor;
+        int majorDir;           // +1 or -1
+        long long minorStep;
+        int first, last;        // Steps that land inside the viewport
+        uint32_t color;
+        DepthMode depth;
+    };
+
+    // Tile bin entries index lines, rather than triangles, with this bit set
+    static const uint32_t LINE_BIN = 1u << 31;
+
+    struct TileCounters {
+        uint64_t triangles, trianglesOccluded, blocks, blocksOccluded, blocksEmpty, pixelsTested, depthWrites;
+    };
+
+    // Tile-local storage while one tile is rasterized
+    struct TileContext {
+        int x, y, w, h;
+        uint32_t* color;
+        float* depth;
+        float* blockMax;        // Farthest depth per 8x8 block, TILE_BLOCKS per row
+        float tileMax;          // Farthest depth in the tile
+        TileCounters counters;
+    };
+
+    Framebuffer& framebuffer;
+    ThreadPool* pool;
+    Mat4 projectionMatrix;
+    uint64_t trianglesSubmitted, trianglesCulled, trianglesRasterized;   // Since the last flush
+
+    // A vertex after transform, perspective divide and viewport mapping
+    struct ScreenVertex {
+        float ndcX, ndcY;
+        int x, y;
+        float depth;
+    };
+
+    int tilesX, tilesY;
+    std::vector<RasterPrimitive> primitives;
+    std::vector<RasterLine> lines;
+    std::vector<TextureSetup> textureSetups;
+    std::vector<std::vector<uint32_t>> tileBins;
+    std::vector<int> activeTiles;
+
+    // Post-transform cache for drawMesh, one SoA entry per mesh vertex
+    std::vector<float> cacheNdcX, cacheNdcY, cacheDepth;
+    std::vector<int> cacheX, cacheY;
+    std::vector<uint16_t> cacheClipCodes;
+    std::vector<uint8_t> faceKept;      // Per face, whether it survived culling in wireframe
+
+    // A triangle clipped against six planes has at most nine vertices
+    static const int MAX_CLIPPED_VERTICES = 9;
+
+    static const size_t TRANSFORM_CHUNK = 16384;
+    
+    // Convert NDC coordinates to screen space
+    ScreenVertex ndcToScreen(const Vec3& ndc) {
+        ScreenVertex v;
+        v.ndcX = ndc.x;
+        v.ndcY = ndc.y;
+        v.x = (int)((ndc.x + 1.0f) * 0.5f * framebuffer.getWidth());
+        v.y = (int)((1.0f - ndc.y) * 0.5f * framebuffer.getHeight());
+        v.depth = ndc.z;
+        return v;
+    }
+
+    void addToBin(int tile, uint32_t entry) {
+        std::vector<uint32_t>& bin = tileBins[tile];
+        if (bin.empty()) activeTiles.push_back(tile);
+        bin.push_back(entry);
+    }
+
+    // Append a triangle to every tile its bounding box touches
+    void binPrimitive(const RasterPrimitive& prim) {
+        int minX = std::max(0, prim.minX);
+        int maxX = std::min(framebuffer.getWidth() - 1, prim.maxX);
+        int minY = std::max(0, prim.minY);
+        int maxY = std::min(framebuffer.getHeight() - 1, prim.maxY);
+        if (minX > maxX || minY > maxY) return;
+
+        uint32_t index = (uint32_t)primitives.size();
+        primitives.push_back(prim);
+        framebuffer.markDrawn(Rect(minX, minY, maxX + 1, maxY + 1));
+
+        for (int ty = minY / TILE_SIZE; ty <= maxY / TILE_SIZE; ty++) {
+            for (int tx = minX / TILE_SIZE; tx <= maxX / TILE_SIZE; tx++) addToBin(ty * tilesX + tx, index);
+        }
+    }
+
+    // Append a line to only the tiles its pixels fall in, row by row
+    void binLine(const RasterLine& line) {
+        int xa, ya, xb, yb;
+        linePixel(line, line.first, xa, ya);
+        linePixel(line, line.last, xb, yb);
+        int minX = std::min(xa, xb), maxX = std::max(xa, xb);
+        int minY = std::min(ya, yb), maxY = std::max(ya, yb);
+
+        uint32_t entry = (uint32_t)lines.size() | LINE_BIN;
+        lines.push_back(line);
+        framebuffer.markDrawn(Rect(minX, minY, maxX + 1, maxY + 1));
+
+        if (minY / TILE_SIZE == maxY / TILE_SIZE) {
+            for (int tx = minX / TILE_SIZE; tx <= maxX / TILE_SIZE; tx++) addToBin(minY / TILE_SIZE * tilesX + tx, entry);
+            return;
+        }
+        for (int ty = minY / TILE_SIZE; ty <= maxY / TILE_SIZE; ty++) {
+            int first = line.first, last = line.last;
+            if (!lineStepsIn(line, minX, ty * TILE_SIZE, maxX, ty * TILE_SIZE + TILE_SIZE - 1, first, last)) continue;
+            linePixel(line, first, xa, ya);
+            linePixel(line, last, xb, yb);
+            for (int tx = std::min(xa, xb) / TILE_SIZE; tx <= std::max(xa, xb) / TILE_SIZE; tx++) {
+                addToBin(ty * tilesX + tx, entry);
+            }
+        }
+    }
+
+    static const long long LINE_ROUND = 1LL << 31;
+
+    // Minor-axis coordinate of a line's pixel at step i
+    static int lineMinor(const RasterLine& line, int i) {
+        int minor0 = line.xMajor ? line.y0 : line.x0;
+        return minor0 + (int)((i * line.minorStep + LINE_ROUND) >> 32);
+    }
+
+    static void linePixel(const RasterLine& line, int i, int& x, int& y) {
+        int major = (line.xMajor ? line.x0 : line.y0) + line.majorDir * i;
+        int minor = lineMinor(line, i);
+        x = line.xMajor ? major : minor;
+        y = line.xMajor ? minor : major;
+    }
+
+    // Narrow the steps [first, last] to those whose pixels fall inside the
+    // rectangle. Both coordinates are monotonic in the step, so the major
+    // axis bounds are solved directly and the minor axis ones by bisection.
+    static bool lineStepsIn(const RasterLine& line, int minX, int minY, int maxX, int maxY, int& first, int& last) {
+        int major0 = line.xMajor ? line.x0 : line.y0;
+        int majorMin = line.xMajor ? minX : minY, majorMax = line.xMajor ? maxX : maxY;
+        int minorMin = line.xMajor ? minY : minX, minorMax = line.xMajor ? maxY : maxX;
+        if (line.majorDir > 0) {
+            first = std::max(first, majorMin - major0);
+            last = std::min(last, majorMax - major0);
+        } else {
+            first = std::max(first, major0 - majorMax);
+            last = std::min(last, major0 - majorMin);
+        }
+        if (first > last) return false;
+
+        // Most lines end up wholly inside: both ends in range means every step is
+        int minorFirst = lineMinor(line, first), minorLast = lineMinor(line, last);
+        if (std::min(minorFirst, minorLast) >= minorMin && std::max(minorFirst, minorLast) <= minorMax) return true;
+
+        bool rising = line.minorStep >= 0;
+        int lo = first, hi = last + 1;
+        while (lo < hi) {       // First step not short of the range
+            int mid = lo + (hi - lo) / 2;
+            int minor = lineMinor(line, mid);
+            if (rising ? minor >= minorMin : minor <= minorMax) hi = mid; else lo = mid + 1;
+        }
+        first = lo;
+        hi = last + 1;
+        while (lo < hi) {       // First step past the range
+            int mid = lo + (hi - lo) / 2;
+            int minor = lineMinor(line, mid);
+            if (rising ? minor > minorMax : minor < minorMin) hi = mid; else lo = mid + 1;
+        }
+        last = lo - 1;
+        return first <= last;
+    }
+
+    // Step the part of a line inside one tile. The pixel offset is a linear
+    // function of the step plus the fixed-point minor offset, so the loop
+    // carries no bounds checks and no loop-carried state.
+    template <DepthMode Depth>
+    static void drawLine(const RasterLine& line, TileContext& tile) {
+        int first = line.first, last = line.last;
+        if (!lineStepsIn(line, tile.x, tile.y, tile.x + tile.w - 1, tile.y + tile.h - 1, first, last)) return;
+
+        int majorStride = line.xMajor ? line.majorDir : line.majorDir * TILE_SIZE;
+        int minorStride = line.xMajor ? TILE_SIZE : 1;
+        int origin = (line.y0 - tile.y) * TILE_SIZE + (line.x0 - tile.x);
+        int written = 0;
+        for (int i = first; i <= last; i++) {
+            int idx = origin + i * majorStride + (int)((i * line.minorStep + LINE_ROUND) >> 32) * minorStride;
+            float depth = line.d0 + line.depthStep * (float)i;
+            if (Depth == DEPTH_OFF || depth < tile.depth[idx]) {
+                if (Depth == DEPTH_TEST_WRITE) tile.depth[idx] = depth;
+                tile.color[idx] = line.color;
+                written++;
+            }
+        }
+        tile.counters.pixelsTested += last - first + 1;
+        tile.counters.depthWrites += written;
+    }
+    
+    // Texture a span of a triangle whose top-left pixel is (x0, y0). Depth
+    // is interpolated as in the flat kernels, so textured and flat faces
+    // meet exactly. Each pixel samples the mip level whose texels are about
+    // a pixel apart there, from the screen-space derivatives of u and v.
+    template <DepthMode Depth, bool Direct>
+    static int shadeTexturedSpan(const TriangleSpan& span, const TextureSetup& setup, int x0, int y0) {
+        const Texture& texture = *setup.texture;
+        float width = (float)texture.getWidth(), height = (float)texture.getHeight();
+        int lastLevel = texture.levelCount() - 1;
+        float qx = setup.q[0] * span.a0 + setup.q[1] * span.a1 + setup.q[2] * span.a2;
+        float qy = setup.q[0] * span.b0 + setup.q[1] * span.b1 + setup.q[2] * span.b2;
+        float uqx = setup.uq[0] * span.a0 + setup.uq[1] * span.a1 + setup.uq[2] * span.a2;
+        float uqy = setup.uq[0] * span.b0 + setup.uq[1] * span.b1 + setup.uq[2] * span.b2;
+        float vqx = setup.vq[0] * span.a0 + setup.vq[1] * span.a1 + setup.vq[2] * span.a2;
+        float vqy = setup.vq[0] * span.b0 + setup.vq[1] * span.b1 + setup.vq[2] * span.b2;
+        int rowW0 = span.w0, rowW1 = span.w1, rowW2 = span.w2;
+        int written = 0;
+
+        for (int y = 0; y < span.height; y++) {
+            uint32_t* color = span.colorRow + y * span.stride;
+            float* depthRow = span.depthRow + y * span.stride;
+            int w0 = rowW0, w1 = rowW1, w2 = rowW2;
+
+            for (int x = 0; x < span.width; x++) {
+                if ((w0 | w1 | w2) >= 0) {
+                    float depth = (span.d0 * (float)w0 + span.d1 * (float)w1 + span.d2 * (float)w2) * span.invArea;
+                    if (Depth == DEPTH_OFF || depth < depthRow[x]) {
+                        if (Depth == DEPTH_TEST_WRITE) depthRow[x] = depth;
+
+                        // The edge functions' scale cancels in the divide
+                        float fw0 = (float)w0, fw1 = (float)w1, fw2 = (float)w2;
+                        float invQ = 1.0f / (setup.q[0] * fw0 + setup.q[1] * fw1 + setup.q[2] * fw2);
+                        float u = (setup.uq[0] * fw0 + setup.uq[1] * fw1 + setup.uq[2] * fw2) * invQ;
+                        float v = (setup.vq[0] * fw0 + setup.vq[1] * fw1 + setup.vq[2] * fw2) * invQ;
+
+                        // d(U/Q) = (dU - u dQ) / Q, in texels per pixel
+                        float dudx = (uqx - u * qx) * invQ * width, dvdx = (vqx - v * qx) * invQ * height;
+                        float dudy = (uqy - u * qy) * invQ * width, dvdy = (vqy - v * qy) * invQ * height;
+                        float rho2 = std::max(dudx * dudx + dvdx * dvdx, dudy * dudy + dvdy * dvdy);
+
+                        // floor(log2(rho)) is half the exponent of rho squared
+                        int level = 0;
+                        if (rho2 >= 4.0f) {
+                            uint32_t bits;
+                            std::memcpy(&bits, &rho2, sizeof(bits));
+                            level = std::min(((int)(bits >> 23) - 127) >> 1, lastLevel);
+                        }
+
+                        Color texel = texture.sample(u, v, level);
+                        uint32_t payload;
+                        if (Direct) {
+                            payload = Framebuffer::directColor(texel, x0 + x, y0 + y);
+                        } else {
+                            std::memcpy(&payload, &texel, sizeof(payload));
+                        }
+                        color[x] = payload;
+                        written++;
+                    }
+                }
+                w0 += span.a0; w1 += span.a1; w2 += span.a2;
+            }
+
+            rowW0 += span.b0; rowW1 += span.b1; rowW2 += span.b2;
+        }
+        return written;
+    }
+
+    // Fill the part of a triangle inside one tile with the selected kernel,
+    // or the texturing one when it has a setup. The whole triangle is
+    // skipped when it is behind everything in the tile, and so are 8x8
+    // blocks it is behind or does not reach into. Runs of live blocks along
+    // a block row go to the kernel as one span.
+    template <DepthMode Depth>
+    static void fillTriangle(const RasterPrimitive& tri, const TextureSetup* setup, TileContext& tile) {
+        // Bounding box clipped to the tile
+        int minX = std::max(tile.x, tri.minX);
+        int maxX = std::min(tile.x + tile.w - 1, tri.maxX);
+        int minY = std::max(tile.y, tri.minY);
+        int maxY = std::min(tile.y + tile.h - 1, tri.maxY);
+        if (minX > maxX || minY > maxY) return;
+
+        tile.counters.triangles++;
+        if (Depth != DEPTH_OFF && tri.nearestDepth >= tile.tileMax) {
+            tile.counters.trianglesOccluded++;
+            return;
+        }
+
+        TriangleSpan span;
+        span.a0 = tri.edgeA[0]; span.a1 = tri.edgeA[1]; span.a2 = tri.edgeA[2];
+        span.b0 = tri.edgeB[0]; span.b1 = tri.edgeB[1]; span.b2 = tri.edgeB[2];
+        span.d0 = tri.d2; span.d1 = tri.d0; span.d2 = tri.d1;
+        span.invArea = tri.invArea;
+        span.color = tri.color;
+        span.stride = TILE_SIZE;
+
+        bool lowered = false;
+        for (int by = (minY - tile.y) / DEPTH_BLOCK; by <= (maxY - tile.y) / DEPTH_BLOCK; by++) {
+            int y0 = std::max(minY, tile.y + by * DEPTH_BLOCK), y1 = std::min(maxY, tile.y + by * DEPTH_BLOCK + DEPTH_BLOCK - 1);
+            int lastBlock = (maxX - tile.x) / DEPTH_BLOCK;
+            int runStart = -1;
+
+            for (int bx = (minX - tile.x) / DEPTH_BLOCK; bx <= lastBlock + 1; bx++) {
+                bool live = false;
+                if (bx <= lastBlock) {
+                    tile.counters.blocks++;
+                    live = updateBlock<Depth>(tri, tile, bx, by, lowered);
+                }
+                if (live && runStart < 0) runStart = bx;
+                if (live || runStart < 0) continue;
+
+                int x0 = std::max(minX, tile.x + runStart * DEPTH_BLOCK), x1 = std::min(maxX, tile.x + bx * DEPTH_BLOCK - 1);
+                span.w0 = (int)(tri.edgeA[0] * (long long)x0 + tri.edgeB[0] * (long long)y0 + tri.edgeC[0]);
+                span.w1 = (int)(tri.edgeA[1] * (long long)x0 + tri.edgeB[1] * (long long)y0 + tri.edgeC[1]);
+                span.w2 = (int)(tri.edgeA[2] * (long long)x0 + tri.edgeB[2] * (long long)y0 + tri.edgeC[2]);
+                span.width = x1 - x0 + 1;
+                span.height = y1 - y0 + 1;
+                span.colorRow = tile.color + (y0 - tile.y) * TILE_SIZE + (x0 - tile.x);
+                span.depthRow = tile.depth + (y0 - tile.y) * TILE_SIZE + (x0 - tile.x);
+                tile.counters.pixelsTested += span.width * span.height;
+                if (!setup) {
+                    tile.counters.depthWrites += triangleKernels[Depth](span);
+                } else if (setup->direct) {
+                    tile.counters.depthWrites += shadeTexturedSpan<Depth, true>(span, *setup, x0, y0);
+                } else {
+                    tile.counters.depthWrites += shadeTexturedSpan<Depth, false>(span, *setup, x0, y0);
+                }
+                runStart = -1;
+            }
+        }
+
+        if (Depth == DEPTH_TEST_WRITE && lowered) updateTileBound(tile);
+    }
+
+    // Whether any pixel of the triangle in block (bx, by) could pass the
+    // depth test. A triangle covering the whole block leaves nothing in it
+    // farther than its own farthest depth, which tightens the block's bound
+    // when the triangle writes depth.
+    template <DepthMode Depth>
+    static bool updateBlock(const RasterPrimitive& tri, TileContext& tile, int bx, int by, bool& lowered) {
+        float& bound = tile.blockMax[by * TILE_BLOCKS + bx];
+        if (Depth != DEPTH_OFF && tri.nearestDepth >= bound) {
+            tile.counters.blocksOccluded++;
+            return false;
+        }
+
+        int x0 = tile.x + bx * DEPTH_BLOCK, x1 = std::min(x0 + DEPTH_BLOCK, tile.x + tile.w) - 1;
+        int y0 = tile.y + by * DEPTH_BLOCK, y1 = std::min(y0 + DEPTH_BLOCK, tile.y + tile.h) - 1;
+        bool covered = true;
+        for (int i = 0; i < 3; i++) {
+            long long a = tri.edgeA[i], b = tri.edgeB[i];
+            // An edge function over a rectangle peaks and dips at its corners
+            long long peak = a * (a > 0 ? x1 : x0) + b * (b > 0 ? y1 : y0) + tri.edgeC[i];
+            long long dip = a * (a > 0 ? x0 : x1) + b * (b > 0 ? y0 : y1) + tri.edgeC[i];
+            if (peak < 0) {
+                tile.counters.blocksEmpty++;
+                return false;
+            }
+            covered = covered && dip >= 0;
+        }
+
+        if (Depth == DEPTH_TEST_WRITE && covered && tri.farthestDepth < bound) {
+            bound = tri.farthestDepth;
+            lowered = true;
+        }
+        return true;
+    }
+
+    static void updateTileBound(TileContext& tile) {
+        tile.tileMax = 0;
+        for (int by = 0; by * DEPTH_BLOCK < tile.h; by++) {
+            for (int bx = 0; bx * DEPTH_BLOCK < tile.w; bx++) {
+                tile.tileMax = std::max(tile.tileMax, tile.blockMax[by * TILE_BLOCKS + bx]);
+            }
+        }
+    }
+
+    // Edge functions w = a*x + b*y + c for the three edges. Returns false for
+    // degenerate triangles, which cover no pixels.
+    static bool setupEdges(RasterPrimitive& tri) {
+        int xs[3] = {tri.x0, tri.x1, tri.x2};
+        int ys[3] = {tri.y0, tri.y1, tri.y2};
+        long long area = 0;
+
+        for (int i = 0; i < 3; i++) {
+            int j = (i + 1) % 3;
+            tri.edgeA[i] = ys[i] - ys[j];
+            tri.edgeB[i] = xs[j] - xs[i];
+            tri.edgeC[i] = -(long long)(xs[j] - xs[i]) * ys[i] + (long long)(ys[j] - ys[i]) * xs[i];
+            area += tri.edgeC[i];
+        }
+        if (area == 0) return false;
+
+        // Orient the edges so covered pixels are positive for either winding
+        if (area < 0) {
+            for (int i = 0; i < 3; i++) {
+                tri.edgeA[i] = -tri.edgeA[i];
+                tri.edgeB[i] = -tri.edgeB[i];
+                tri.edgeC[i] = -tri.edgeC[i];
+            }
+            area = -area;
+        }
+        tri.invArea = 1.0f / (float)area;
+
+        // Interpolated depths are convex combinations of the vertex depths,
+        // give or take rounding, which the margin covers
+        float largest = std::max({std::fabs(tri.d0), std::fabs(tri.d1), std::fabs(tri.d2)});
+        tri.nearestDepth = std::min({tri.d0, tri.d1, tri.d2}) - largest * 1e-5f;
+        tri.farthestDepth = std::max({tri.d0, tri.d1, tri.d2}) + largest * 1e-5f;
+        return true;
+    }
+
+    // Rasterize every primitive binned to one tile, in submission order
+    void rasterizeTile(int tileIndex) {
+        // Padded by one vector so SIMD kernels can run past the last column
+        thread_local std::vector<uint32_t> tileColor;
+        thread_local std::vector<float> tileDepth;
+        thread_local std::vector<float> tileBlockMax;
+        if (tileColor.empty()) {
+            tileColor.resize(TILE_SIZE * TILE_SIZE + 8, 0);
+            tileDepth.resize(TILE_SIZE * TILE_SIZE + 8, 1.0f);
+            tileBlockMax.resize(TILE_BLOCKS * TILE_BLOCKS, 1.0f);
+        }
+
+        TileContext tile;
+        tile.x = (tileIndex % tilesX) * TILE_SIZE;
+        tile.y = (tileIndex / tilesX) * TILE_SIZE;
+        tile.w = std::min(TILE_SIZE, framebuffer.getWidth() - tile.x);
+        tile.h = std::min(TILE_SIZE, framebuffer.getHeight() - tile.y);
+        tile.color = tileColor.data();
+        tile.depth = tileDepth.data();
+        tile.blockMax = tileBlockMax.data();
+        tile.counters = TileCounters();
+
+        framebuffer.loadTile(tile.x, tile.y, tile.w, tile.h, tile.color, tile.depth, tile.blockMax, TILE_SIZE);
+        updateTileBound(tile);
+
+        for (uint32_t entry : tileBins[tileIndex]) {
+            if (entry & LINE_BIN) {
+                const RasterLine& line = lines[entry & ~LINE_BIN];
+                switch (line.depth) {
+                    case DEPTH_TEST_WRITE: drawLine<DEPTH_TEST_WRITE>(line, tile); break;
+                    case DEPTH_TEST:       drawLine<DEPTH_TEST>(line, tile); break;
+                    default:               drawLine<DEPTH_OFF>(line, tile); break;
+                }
+                continue;
+            }
+            const RasterPrimitive& tri = primitives[entry];
+            const TextureSetup* setup = tri.texture == NO_TEXTURE ? nullptr : &textureSetups[tri.texture];
+            switch (tri.depth) {
+                case DEPTH_TEST_WRITE: fillTriangle<DEPTH_TEST_WRITE>(tri, setup, tile); break;
+                case DEPTH_TEST:       fillTriangle<DEPTH_TEST>(tri, setup, tile); break;
+                default:               fillTriangle<DEPTH_OFF>(tri, setup, tile); break;
+            }
+        }
+
+        framebuffer.storeTile(tile.x, tile.y, tile.w, tile.h, tile.color, tile.depth, tile.blockMax, TILE_SIZE);
+
+        rasterStats.tileTriangles += tile.counters.triangles;
+        rasterStats.tileTrianglesOccluded += tile.counters.trianglesOccluded;
+        rasterStats.blocks += tile.counters.blocks;
+        rasterStats.blocksOccluded += tile.counters.blocksOccluded;
+        rasterStats.blocksEmpty += tile.counters.blocksEmpty;
+        rasterStats.pixelsTested += tile.counters.pixelsTested;
+        rasterStats.depthWrites += tile.counters.depthWrites;
+    }
+
+    // Set up a line's DDA and clip its steps to the viewport, so only
+    // visible pixels are ever walked, then bin it
+    void submitLine(const ScreenVertex& p0, const ScreenVertex& p1, uint32_t color, DepthMode depth) {
+        RasterLine line;
+        line.x0 = p0.x;
+        line.y0 = p0.y;
+        line.d0 = p0.depth;
+        line.color = color;
+        line.depth = depth;
+
+        int dx = p1.x - p0.x, dy = p1.y - p0.y;
+        line.xMajor = std::abs(dx) >= std::abs(dy);
+        int major = line.xMajor ? dx : dy, minor = line.xMajor ? dy : dx;
+        int count = std::abs(major);
+        line.majorDir = major < 0 ? -1 : 1;
+        line.minorStep = count > 0 ? (long long)minor * (1LL << 32) / count : 0;
+        line.depthStep = count > 0 ? (p1.depth - p0.depth) / (float)count : 0.0f;
+
+        int first = 0, last = count;
+        if (!lineStepsIn(line, 0, 0, framebuffer.getWidth() - 1, framebuffer.getHeight() - 1, first, last)) return;
+        line.first = first;
+        line.last = last;
+        binLine(line);
+    }
+    
+    ScreenVertex cachedVertex(uint32_t i) const {
+        return ScreenVertex{cacheNdcX[i], cacheNdcY[i], cacheX[i], cacheY[i], cacheDepth[i]};
+    }
+
+    // Whether a face with this signed area survives the cull mode
+    template <CullMode Cull>
+    static bool facingKept(float area) {
+        if (Cull == CULL_BACK) return area >= 0;
+        if (Cull == CULL_FRONT) return area <= 0;
+        return true;
+    }
+
+    // Twice the signed area in NDC, positive for front faces
+    static float facingArea(const ScreenVertex& v0, const ScreenVertex& v1, const ScreenVertex& v2) {
+        float e1x = v1.ndcX - v0.ndcX, e1y = v1.ndcY - v0.ndcY;
+        float e2x = v2.ndcX - v0.ndcX, e2y = v2.ndcY - v0.ndcY;
+        return e1x * e2y - e1y * e2x;
+    }
+
+    // Cull, set up and bin one triangle, or its three edges in wireframe.
+    // Solid triangles with texture coordinates sample the texture instead of color.
+    template <FillMode Fill, CullMode Cull>
+    void submitTriangle(const ScreenVertex& v0, const ScreenVertex& v1, const ScreenVertex& v2,
+                        uint32_t color, DepthMode depth, const TexCoord* tex = nullptr, const Texture* texture = nullptr) {
+        if (!facingKept<Cull>(facingArea(v0, v1, v2))) {
+            trianglesCulled++;
+            return;
+        }
+        
+        if (Fill == FILL_SOLID) {
+            RasterPrimitive tri = {v0.x, v0.y, v1.x, v1.y, v2.x, v2.y, v0.depth, v1.depth, v2.depth,
+                                   0, 0, 0, 0, color, {}, {}, {}, 0, 0, 0, depth, NO_TEXTURE};
+            tri.minX = std::min({tri.x0, tri.x1, tri.x2});
+            tri.maxX = std::max({tri.x0, tri.x1, tri.x2});
+            tri.minY = std::min({tri.y0, tri.y1, tri.y2});
+            tri.maxY = std::max({tri.y0, tri.y1, tri.y2});
+            // Off screen or too thin to cover a pixel row or column
+            if (tri.maxX < 0 || tri.minX >= framebuffer.getWidth() || tri.maxY < 0 || tri.minY >= framebuffer.getHeight() ||
+                tri.minX == tri.maxX || tri.minY == tri.maxY || !setupEdges(tri)) {
+                trianglesCulled++;
+                return;
+            }
+            if (tex) {
+                TextureSetup setup;
+                setup.texture = texture;
+                setup.direct = framebuffer.getTarget() == RENDER_TARGET_YUV420;
+                for (int i = 0; i < 3; i++) {
+                    const TexCoord& vertex = tex[(i + 2) % 3];
+                    setup.q[i] = vertex.q;
+                    setup.uq[i] = vertex.uq;
+                    setup.vq[i] = vertex.vq;
+                }
+                tri.texture = (uint32_t)textureSetups.size();
+                textureSetups.push_back(setup);
+            }
+            trianglesRasterized++;
+            binPrimitive(tri);
+        } else {
+            submitLine(v0, v1, color, depth);
+            submitLine(v1, v2, color, depth);
+            submitLine(v2, v0, color, depth);
+        }
+    }
+    
+    // Clip a triangle in homogeneous space against the planes its vertices
+    // cross, then submit the fan of the clipped polygon. Every vertex left
+    // has w > 0, so the perspective divide and the backface test are sound.
+    // Wireframe draws only the parts of the original edges, not the cuts.
+    // Texture coordinates, when given, are affine in clip space and clipped alongside.
+    template <FillMode Fill, CullMode Cull>
+    void clipTriangle(const Vec4 clip[3], int planes, uint32_t color, DepthMode depth,
+                      const float (*uv)[2] = nullptr, const Texture* texture = nullptr) {
+        Vec4 buffers[2][MAX_CLIPPED_VERTICES];
+        bool edgeBuffers[2][MAX_CLIPPED_VERTICES];    // Edge from vertex i to i+1 is part of an original edge
+        float uvBuffers[2][MAX_CLIPPED_VERTICES][2];
+        Vec4* in = buffers[0];
+        Vec4* out = buffers[1];
+        bool* inEdges = edgeBuffers[0];
+        bool* outEdges = edgeBuffers[1];
+        float (*inUv)[2] = uvBuffers[0];
+        float (*outUv)[2] = uvBuffers[1];
+        int count = 3;
+        for (int i = 0; i < 3; i++) {
+            in[i] = clip[i];
+            inEdges[i] = true;
+            if (uv) {
+                inUv[i][0] = uv[i][0];
+                inUv[i][1] = uv[i][1];
+            }
+        }
+
+        for (int bit = CLIP_NEAR; bit <= CLIP_GUARD_TOP && count > 0; bit <<= 1) {
+            if (!(planes & bit)) continue;
+
+            int outCount = 0;
+            for (int i = 0; i < count; i++) {
+                const Vec4& a = in[i];
+                const Vec4& b = in[(i + 1) % count];
+                float da = clipDistance(a, bit), db = clipDistance(b, bit);
+                if (da >= 0) {
+                    out[outCount] = a;
+                    if (uv) {
+                        outUv[outCount][0] = inUv[i][0];
+                        outUv[outCount][1] = inUv[i][1];
+                    }
+                    outEdges[outCount++] = inEdges[i];
+                }
+                if ((da >= 0) != (db >= 0)) {
+                    float t = da / (da - db);
+                    out[outCount] = Vec4(a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t,
+                                         a.z + (b.z - a.z) * t, a.w + (b.w - a.w) * t);
+                    if (uv) {
+                        int j = (i + 1) % count;
+                        outUv[outCount][0] = inUv[i][0] + (inUv[j][0] - inUv[i][0]) * t;
+                        outUv[outCount][1] = inUv[i][1] + (inUv[j][1] - inUv[i][1]) * t;
+                    }
+                    outEdges[outCount++] = da >= 0 ? false : inEdges[i];
+                }
+            }
+            std::swap(in, out);
+            std::swap(inEdges, outEdges);
+            std::swap(inUv, outUv);
+            count = outCount;
+        }
+        if (count < 3) {
+            trianglesCulled++;
+            return;
+        }
+
+        ScreenVertex screen[MAX_CLIPPED_VERTICES];
+        for (int i = 0; i < count; i++) screen[i] = ndcToScreen(in[i].toVec3());
+
+        if (Fill == FILL_SOLID && uv) {
+            TexCoord tex[MAX_CLIPPED_VERTICES];
+            for (int i = 0; i < count; i++) {
+                float q = 1.0f / in[i].w;
+                tex[i] = TexCoord{q, inUv[i][0] * q, inUv[i][1] * q};
+            }
+            for (int i = 1; i + 1 < count; i++) {
+                TexCoord fan[3] = {tex[0], tex[i], tex[i + 1]};
+                submitTriangle<Fill, Cull>(screen[0], screen[i], screen[i + 1], color, depth, fan, texture);
+            }
+            return;
+        }
+        if (Fill == FILL_SOLID) {
+            for (int i = 1; i + 1 < count; i++) submitTriangle<Fill, Cull>(screen[0], screen[i], screen[i + 1], color, depth);
+            return;
+        }
+
+        // Cull the polygon as a whole by its signed area, then draw its original edges
+        float area = 0;
+        for (int i = 0; i < count; i++) {
+            const ScreenVertex& a = screen[i];
+            const ScreenVertex& b = screen[(i + 1) % count];
+            area += a.ndcX * b.ndcY - b.ndcX * a.ndcY;
+        }
+        if (!facingKept<Cull>(area)) return;
+        for (int i = 0; i < count; i++) {
+            if (inEdges[i]) submitLine(screen[i], screen[(i + 1) % count], color, depth);
+        }
+    }
+
+    // Clip a line in homogeneous space against the planes its ends cross
+    void clipLine(const Vec4& a, const Vec4& b, int planes, uint32_t color, DepthMode depth) {
+        float t0 = 0.0f, t1 = 1.0f;
+        for (int bit = CLIP_NEAR; bit <= CLIP_GUARD_TOP; bit <<= 1) {
+            if (!(planes & bit)) continue;
+            float da = clipDistance(a, bit), db = clipDistance(b, bit);
+            if (da < 0 && db < 0) return;
+            if (da < 0) t0 = std::max(t0, da / (da - db));
+            if (db < 0) t1 = std::min(t1, da / (da - db));
+        }
+        if (t0 > t1) return;
+
+        Vec4 d(b.x - a.x, b.y - a.y, b.z - a.z, b.w - a.w);
+        Vec4 p0(a.x + d.x * t0, a.y + d.y * t0, a.z + d.z * t0, a.w + d.w * t0);
+        Vec4 p1(a.x + d.x * t1, a.y + d.y * t1, a.z + d.z * t1, a.w + d.w * t1);
+        submitLine(ndcToScreen(p0.toVec3()), ndcToScreen(p1.toVec3()), color, depth);
+    }
+
+    // Signed distance to a clip plane in homogeneous space, >= 0 inside
+    static float clipDistance(const Vec4& v, int plane) {
+        switch (plane) {
+            case CLIP_NEAR:         return v.z + v.w;
+            case CLIP_FAR:          return v.w - v.z;
+            case CLIP_GUARD_LEFT:   return v.x + GUARD_BAND * v.w;
+            case CLIP_GUARD_RIGHT:  return GUARD_BAND * v.w - v.x;
+            case CLIP_GUARD_BOTTOM: return v.y + GUARD_BAND * v.w;
+            default:                return GUARD_BAND * v.w - v.y;
+        }
+    }
+
+    // Clip or cull one transformed triangle and submit what is left
+    template <FillMode Fill, CullMode Cull>
+    void assembleTriangle(const Vec4* clip, uint32_t color, DepthMode depth) {
+        int c0 = clipCode(clip[0].x, clip[0].y, clip[0].z, clip[0].w);
+        int c1 = clipCode(clip[1].x, clip[1].y, clip[1].z, clip[1].w);
+        int c2 = clipCode(clip[2].x, clip[2].y, clip[2].z, clip[2].w);
+        if (c0 & c1 & c2 & CLIP_REJECT_MASK) {
+            trianglesCulled++;
+            return;
+        }
+        if ((c0 | c1 | c2) & CLIP_PLANE_MASK) {
+            clipTriangle<Fill, Cull>(clip, (c0 | c1 | c2) & CLIP_PLANE_MASK, color, depth);
+            return;
+        }
+        submitTriangle<Fill, Cull>(ndcToScreen(clip[0].toVec3()), ndcToScreen(clip[1].toVec3()),
+                                   ndcToScreen(clip[2].toVec3()), color, depth);
+    }
+
+    // Assemble the mesh's triangles from the post-transform cache. The
+    // textured path gives the mesh's textured faces their coordinates over w.
+    template <FillMode Fill, CullMode Cull, bool Textured>
+    void assembleMesh(const MeshView& mesh, const Mat4& mvp, DepthMode depth, const Texture* texture) {
+        if (Fill == FILL_WIREFRAME && mesh.edges) {
+            assembleEdges<Cull>(mesh, mvp, depth);
+            return;
+        }
+
+        // Faces usually come in runs of one colour, so remember the last payload.
+        // Nothing is encoded up front: in YUV420 mode that would spend a palette slot.
+        Color lastColor(0, 0, 0, 0);
+        uint32_t payload = 0;
+        bool encoded = false;
+        const uint32_t* index = mesh.indices;
+        for (size_t i = 0; i < mesh.triangleCount; i++, index += 3) {
+            const Color& color = mesh.faceColors[i];
+            if (!encoded || std::memcmp(&color, &lastColor, sizeof(Color)) != 0) {
+                lastColor = color;
+                payload = framebuffer.encodeColor(color);
+                encoded = true;
+            }
+
+            int c0 = cacheClipCodes[index[0]], c1 = cacheClipCodes[index[1]], c2 = cacheClipCodes[index[2]];
+            if (c0 & c1 & c2 & CLIP_REJECT_MASK) {
+                trianglesCulled++;
+                continue;
+            }
+            bool textured = Textured && mesh.texturedFaces[i];
+            if ((c0 | c1 | c2) & CLIP_PLANE_MASK) {
+                Vec4 clip[3];
+                float uv[3][2];
+                for (int k = 0; k < 3; k++) {
+                    uint32_t v = index[k];
+                    clip[k] = mvp * Vec4(mesh.px[v], mesh.py[v], mesh.pz[v]);
+                    if (textured) {
+                        uv[k][0] = mesh.texU[v];
+                        uv[k][1] = mesh.texV[v];
+                    }
+                }
+                clipTriangle<Fill, Cull>(clip, (c0 | c1 | c2) & CLIP_PLANE_MASK, payload, depth,
+                                         textured ? uv : nullptr, texture);
+                continue;
+            }
+            if (textured) {
+                TexCoord tex[3];
+                for (int k = 0; k < 3; k++) {
+                    uint32_t v = index[k];
+                    float q = 1.0f / (mvp.m[3][0] * mesh.px[v] + mvp.m[3][1] * mesh.py[v] + mvp.m[3][2] * mesh.pz[v] + mvp.m[3][3]);
+                    tex[k] = TexCoord{q, mesh.texU[v] * q, mesh.texV[v] * q};
+                }
+                submitTriangle<Fill, Cull>(cachedVertex(index[0]), cachedVertex(index[1]), cachedVertex(index[2]), payload,
+                                           depth, tex, texture);
+                continue;
+            }
+            submitTriangle<Fill, Cull>(cachedVertex(index[0]), cachedVertex(index[1]), cachedVertex(index[2]), payload, depth);
+        }
+    }
+
+    // Wireframe from the mesh's unique edge list: each edge is drawn once, in
+    // the colour of the first face beside it that survives culling
+    template <CullMode Cull>
+    void assembleEdges(const MeshView& mesh, const Mat4& mvp, DepthMode depth) {
+        if (Cull != CULL_NONE) {
+            faceKept.resize(mesh.triangleCount);
+            const uint32_t* index = mesh.indices;
+            for (size_t i = 0; i < mesh.triangleCount; i++, index += 3) {
+                int c0 = cacheClipCodes[index[0]], c1 = cacheClipCodes[index[1]], c2 = cacheClipCodes[index[2]];
+                bool kept;
+                if (c0 & c1 & c2 & CLIP_REJECT_MASK) {
+                    kept = false;
+                } else if ((c0 | c1 | c2) & CLIP_PLANE_MASK) {
+                    // The clip-space determinant has the sign of the projected
+                    // area over the part of the face in front of the eye
+                    Vec4 p[3];
+                    for (int k = 0; k < 3; k++) {
+                        uint32_t v = index[k];
+                        p[k] = mvp * Vec4(mesh.px[v], mesh.py[v], mesh.pz[v]);
+                    }
+                    float det = p[0].x * (p[1].y * p[2].w - p[2].y * p[1].w) -
+                                p[0].y * (p[1].x * p[2].w - p[2].x * p[1].w) +
+                                p[0].w * (p[1].x * p[2].y - p[2].x * p[1].y);
+                    kept = facingKept<Cull>(det);
+                } else {
+                    kept = facingKept<Cull>(facingArea(cachedVertex(index[0]), cachedVertex(index[1]), cachedVertex(index[2])));
+                }
+                faceKept[i] = kept;
+                if (!kept) trianglesCulled++;
+            }
+        }
+
+        Color lastColor(0, 0, 0, 0);
+        uint32_t payload = 0;
+        bool encoded = false;
+        for (size_t i = 0; i < mesh.edgeCount; i++) {
+            const MeshEdge& edge = mesh.edges[i];
+            uint32_t face = edge.faces[0];
+            if (Cull != CULL_NONE && !faceKept[face]) {
+                face = edge.faces[1];
+                if (face == NO_FACE || !faceKept[face]) continue;
+            }
+
+            int c0 = cacheClipCodes[edge.v0], c1 = cacheClipCodes[edge.v1];
+            if (c0 & c1 & CLIP_REJECT_MASK) continue;
+            const Color& color = mesh.faceColors[face];
+            if (!encoded || std::memcmp(&color, &lastColor, sizeof(Color)) != 0) {
+                lastColor = color;
+                payload = framebuffer.encodeColor(color);
+                encoded = true;
+            }
+            if ((c0 | c1) & CLIP_PLANE_MASK) {
+                clipLine(mvp * Vec4(mesh.px[edge.v0], mesh.py[edge.v0], mesh.pz[edge.v0]),
+                         mvp * Vec4(mesh.px[edge.v1], mesh.py[edge.v1], mesh.pz[edge.v1]),
+                         (c0 | c1) & CLIP_PLANE_MASK, payload, depth);
+                continue;
+            }
+            submitLine(cachedVertex(edge.v0), cachedVertex(edge.v1), payload, depth);
+        }
+    }
+
+public:
+    // Primitives are binned into screen tiles as they are submitted and
+    // rasterized by flush(). Tiles run in parallel on the pool when given one.
+    Renderer(Framebuffer& fb, ThreadPool* pool = nullptr)
+        : framebuffer(fb), pool(pool), trianglesSubmitted(0), trianglesCulled(0), trianglesRasterized(0) {
+        projectionMatrix = defaultProjection((float)fb.getWidth() / (float)fb.getHeight());
+
+        tilesX = (fb.getWidth() + TILE_SIZE - 1) / TILE_SIZE;
+        tilesY = (fb.getHeight() + TILE_SIZE - 1) / TILE_SIZE;
+        tileBins.resize(tilesX * tilesY);
+    }
+    
+    void drawTriangle(Vec3 v0, Vec3 v1, Vec3 v2, const Mat4& mvp, const Color& color,
+                      const RasterState& state = RasterState()) {
+        typedef void (Renderer::*Assembler)(const Vec4*, uint32_t, DepthMode);
+        static const Assembler assemblers[FILL_MODE_COUNT][CULL_MODE_COUNT] = {
+            {&Renderer::assembleTriangle<FILL_SOLID, CULL_BACK>, &Renderer::assembleTriangle<FILL_SOLID, CULL_FRONT>,
+             &Renderer::assembleTriangle<FILL_SOLID, CULL_NONE>},
+            {&Renderer::assembleTriangle<FILL_WIREFRAME, CULL_BACK>, &Renderer::assembleTriangle<FILL_WIREFRAME, CULL_FRONT>,
+             &Renderer::assembleTriangle<FILL_WIREFRAME, CULL_NONE>}};
+
+        Vec4 clip[3] = {mvp * Vec4(v0), mvp * Vec4(v1), mvp * Vec4(v2)};
+        trianglesSubmitted++;
+        (this->*assemblers[state.fill][state.cull])(clip, framebuffer.encodeColor(color), state.depth);
+    }
+
+    // Transform every vertex of the mesh once into the post-transform cache,
+    // then assemble, cull and bin its triangles from there with the path
+    // specialised for the state
+    void drawMesh(const MeshView& mesh, const Mat4& mvp, const RasterState& state = RasterState()) {
+        typedef void (Renderer::*Assembler)(const MeshView&, const Mat4&, DepthMode, const Texture*);
+        static const Assembler assemblers[FILL_MODE_COUNT][CULL_MODE_COUNT] = {
+            {&Renderer::assembleMesh<FILL_SOLID, CULL_BACK, false>, &Renderer::assembleMesh<FILL_SOLID, CULL_FRONT, false>,
+             &Renderer::assembleMesh<FILL_SOLID, CULL_NONE, false>},
+            {&Renderer::assembleMesh<FILL_WIREFRAME, CULL_BACK, false>, &Renderer::assembleMesh<FILL_WIREFRAME, CULL_FRONT, false>,
+             &Renderer::assembleMesh<FILL_WIREFRAME, CULL_NONE, false>}};
+        static const Assembler texturedAssemblers[CULL_MODE_COUNT] = {
+            &Renderer::assembleMesh<FILL_SOLID, CULL_BACK, true>, &Renderer::assembleMesh<FILL_SOLID, CULL_FRONT, true>,
+            &Renderer::assembleMesh<FILL_SOLID, CULL_NONE, true>};
+
+        size_t count = mesh.vertexCount;
+        if (count == 0) return;
+        trianglesSubmitted += mesh.triangleCount;
+
+        if (cacheX.size() < count) {
+            cacheNdcX.resize(count);
+            cacheNdcY.resize(count);
+            cacheDepth.resize(count);
+            cacheX.resize(count);
+            cacheY.resize(count);
+            cacheClipCodes.resize(count);
+        }
+
+        VertexTransformBatch batch;
+        batch.px = mesh.px;
+        batch.py = mesh.py;
+        batch.pz = mesh.pz;
+        std::memcpy(batch.m, mvp.m, sizeof(batch.m));
+        batch.width = (float)framebuffer.getWidth();
+        batch.height = (float)framebuffer.getHeight();
+        batch.ndcX = cacheNdcX.data();
+        batch.ndcY = cacheNdcY.data();
+        batch.depth = cacheDepth.data();
+        batch.screenX = cacheX.data();
+        batch.screenY = cacheY.data();
+        batch.clipCodes = cacheClipCodes.data();
+
+        int chunks = (int)((count + TRANSFORM_CHUNK - 1) / TRANSFORM_CHUNK);
+        auto transformChunk = [&](int chunk) {
+            size_t begin = chunk * TRANSFORM_CHUNK;
+            vertexTransformKernel(batch, begin, std::min(count, begin + TRANSFORM_CHUNK));
+        };
+        if (pool && chunks > 1) {
+            pool->parallelFor(chunks, transformChunk);
+        } else {
+            for (int chunk = 0; chunk < chunks; chunk++) transformChunk(chunk);
+        }
+
+        // Wireframe ignores textures
+        bool textured = state.fill == FILL_SOLID && state.texture && mesh.texturedFaces && mesh.texU;
+        Assembler assemble = textured ? texturedAssemblers[state.cull] : assemblers[state.fill][state.cull];
+        (this->*assemble)(mesh, mvp, state.depth, state.texture);
+    }
+
+    // Rasterize everything submitted since the last flush into the framebuffer
+    void flush() {
+        if (pool) {
+            pool->parallelFor((int)activeTiles.size(), [this](int i) { rasterizeTile(activeTiles[i]); });
+        } else {
+            for (int tile : activeTiles) rasterizeTile(tile);
+        }
+
+        for (int tile : activeTiles) tileBins[tile].clear();
+        activeTiles.clear();
+        primitives.clear();
+        lines.clear();
+        textureSetups.clear();
+
+        rasterStats.frames++;
+        rasterStats.pixels += (uint64_t)framebuffer.getWidth() * framebuffer.getHeight();
+        rasterStats.trianglesSubmitted += trianglesSubmitted;
+        rasterStats.trianglesCulled += trianglesCulled;
+        rasterStats.trianglesRasterized += trianglesRasterized;
+        rasterStats.paletteOverflows += framebuffer.takePaletteOverflows();
+        trianglesSubmitted = trianglesCulled = trianglesRasterized = 0;
+    }
+    
+    Mat4 getProjectionMatrix() const { return projectionMatrix; }
+    ThreadPool* getPool() const { return pool; }
+
+    static Mat4 defaultProjection(float aspect) {
+        float fov = 60.0f * PI / 180.0f;
+        return Mat4::perspective(fov, aspect, 0.1f, 100.0f);
+    }
+};
+
+// ============================================================================
+// Phone Definition
+// ============================================================================
+
+struct Phone {
+    std::vector<Vec3> vertices;
+    std::vector<std::vector<int>> faces;
+    std::vector<Color> faceColors;
+    int screenFaces;        // The first faces, the front: show a screen texture when drawn with one
+    Mesh mesh;              // Indexed copy of the above, what render() draws
+    
+    Phone(float width = 1.0f, float height = 2.0f, float thickness = 0.15f) {
+        // Simple iPhone-like proportions (1:2 ratio like the SVG)
+        float w = width / 2.0f;   // Half width  
+        float h = height / 2.0f;  // Half height
+        float t = thickness / 2.0f; // Half thickness
+        
+        // Colors matching the SVG exactly
+        Color frameColor(45, 55, 72);        // #2D3748 - Phone frame
+        Color screenColor(26, 32, 44);       // #1A202C - Screen area
+        Color edgeColor(74, 85, 104);        // Edges/sides
+        Color cameraColor(113, 128, 150);    // Camera
+        
+        vertices.clear();
+        faces.clear();
+        faceColors.clear();
+        
+        // Create a simple rectangular phone (8 vertices for a box)
+        // Front face vertices (screen side - Z = +t)
+        vertices.push_back(Vec3(-w, -h, t));  // 0: bottom-left front
+        vertices.push_back(Vec3( w, -h, t));  // 1: bottom-right front
+        vertices.push_back(Vec3( w,  h, t));  // 2: top-right front
+        vertices.push_back(Vec3(-w,  h, t));  // 3: top-left front
+        
+        // Back face vertices (Z = -t)
+        vertices.push_back(Vec3(-w, -h, -t)); // 4: bottom-left back
+        vertices.push_back(Vec3( w, -h, -t)); // 5: bottom-right back
+        vertices.push_back(Vec3( w,  h, -t)); // 6: top-right back
+        vertices.push_back(Vec3(-w,  h, -t)); // 7: top-left back
+        
+        // Define the 6 faces of the rectangular phone (12 triangles total)
+        
+        // Front face (screen) - 2 triangles
+        faces.push_back({0, 1, 2}); faceColors.push_back(screenColor);
+        faces.push_back({0, 2, 3}); faceColors.push_back(screenColor);
+        screenFaces = 2;
+        
+        // Back face - 2 triangles (note: reverse winding for outward normal)
+        faces.push_back({4, 6, 5}); faceColors.push_back(frameColor);
+        faces.push_back({4, 7, 6}); faceColors.push_back(frameColor);
+        
+        // Bottom face - 2 triangles
+        faces.push_back({0, 4, 5}); faceColors.push_back(edgeColor);
+        faces.push_back({0, 5, 1}); faceColors.push_back(edgeColor);
+        
+        // Top face - 2 triangles
+        faces.push_back({2, 6, 7}); faceColors.push_back(edgeColor);
+        faces.push_back({2, 7, 3}); faceColors.push_back(edgeColor);
+        
+        // Left face - 2 triangles
+        faces.push_back({0, 3, 7}); faceColors.push_back(edgeColor);
+        faces.push_back({0, 7, 4}); faceColors.push_back(edgeColor);
+        
+        // Right face - 2 triangles
+        faces.push_back({1, 5, 6}); faceColors.push_back(edgeColor);
+        faces.push_back({1, 6, 2}); faceColors.push_back(edgeColor);
+        
+        // Add small camera bump on back
+        float camX = w * 0.7f;      // Position on back
+        float camY = h * 0.7f;
+        float camSize = 0.08f;
+        float camHeight = 0.03f;
+        
+        // Camera vertices (simple square bump)
+        int camBase = vertices.size();
+        vertices.push_back(Vec3(camX - camSize, camY - camSize, -t - camHeight)); // 8
+        vertices.push_back(Vec3(camX + camSize, camY - camSize, -t - camHeight)); // 9
+        vertices.push_back(Vec3(camX + camSize, camY + camSize, -t - camHeight)); // 10
+        vertices.push_back(Vec3(camX - camSize, camY + camSize, -t - camHeight)); // 11
+        
+        // Camera faces (just the front face of the bump)
+        faces.push_back({camBase, camBase + 1, camBase + 2}); faceColors.push_back(cameraColor);
+        faces.push_back({camBase, camBase + 2, camBase + 3}); faceColors.push_back(cameraColor);
+        
+        buildMesh();
+    }
+    
+    void buildMesh() {
+        mesh = Mesh();
+        for (const Vec3& v : vertices) mesh.addVertex(v);
+        for (size_t i = 0; i < faces.size(); i++) {
+            const auto& face = faces[i];
+            if (face.size() >= 3) mesh.addTriangle(face[0], face[1], face[2], faceColors[i]);
+        }
+        mesh.buildEdges();
+
+        // The screen covers the front face, top-left corner (vertex 3) at (0, 0)
+        for (uint32_t i = 0; i < 4; i++) mesh.setTexCoord(i, vertices[i].x > 0 ? 1.0f : 0.0f, vertices[i].y > 0 ? 0.0f : 1.0f);
+        for (int i = 0; i < screenFaces; i++) mesh.setTextured(i);
+    }
+    
+    void render(Renderer& renderer, const Mat4& modelMatrix, bool wireframe = false, const Texture* screen = nullptr) {
+        Mat4 mvp = renderer.getProjectionMatrix() * modelMatrix;
+        RasterState state;
+        if (wireframe) state.fill = FILL_WIREFRAME;
+        state.texture = screen;
+        renderer.drawMesh(mesh.view(), mvp, state);
+    }
+};
+
+// ============================================================================
+// Mesh Files
+// ============================================================================
+
+// Binary mesh layout: a fixed header, then the x, y and z position arrays,
+// the index buffer, one RGBA colour per triangle and the unique edge list
+// for wireframe. Each section starts on a 64-byte boundary so the mapped
+// arrays feed the vector kernels in place. Files are native little-endian.
+// Any file can be handed to --mesh, so loading checks the layout and, unless
+// the file is this tool's own import cache, that every index names a vertex
+// and every edge a vertex and face.
+static const char MESH_FILE_MAGIC[8] = {'V', 'R', 'M', 'E', 'S', 'H', '\r', '\n'};
+static const uint32_t MESH_FILE_VERSION = 2;
+static const uint64_t MESH_SECTION_ALIGN = 64;
+static const char* MESH_FILE_EXTENSION = ".vrmesh";
+
+struct MeshFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint64_t vertexCount;
+    uint64_t triangleCount;
+    uint64_t positionOffset[3];
+    uint64_t indexOffset;
+    uint64_t colorOffset;
+    uint64_t edgeOffset;
+    uint64_t edgeCount;     // MeshEdges, see Mesh::buildEdges
+    uint64_t fileSize;
+    float boundsMin[3];
+    float boundsMax[3];
+    int64_t sourceSize;     // Size and mtime of the file this was imported
+    int64_t sourceMtime;    // from, so a stale cache gets re-imported
+};
+
+// Colour for faces of imported meshes that carry none, the phone's frame colour
+static const Color DEFAULT_MESH_COLOR(45, 55, 72);
+
+static uint64_t alignSection(uint64_t offset) {
+    return (offset + MESH_SECTION_ALIGN - 1) & ~(MESH_SECTION_ALIGN - 1);
+}
+
+static uint8_t unitToByte(double v) {
+    return (uint8_t)std::lround(std::min(1.0, std::max(0.0, v)) * 255.0);
+}
+
+static std::string lowercaseExtension(const std::string& path) {
+    size_t dot = path.find_last_of('.');
+    size_t slash = path.find_last_of('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) return "";
+    std::string ext = path.substr(dot);
+    for (char& c : ext) c = (char)std::tolower((unsigned char)c);
+    return ext;
+}
+
+static bool readFile(const std::string& path, std::string& contents) {
+    FILE* file = std::fopen(path.c_str(), "rb");
+    if (!file) return false;
+    std::fseek(file, 0, SEEK_END);
+    long size = std::ftell(file);
+    std::fseek(file, 0, SEEK_SET);
+    contents.resize(size > 0 ? (size_t)size : 0);
+    bool ok = size >= 0 && std::fread(&contents[0], 1, contents.size(), file) == contents.size();
+    std::fclose(file);
+    return ok;
+}
+
+// Write a mesh in the binary layout, via a temporary file so concurrent
+// readers never map a half-written cache
+static bool writeMeshFile(const Mesh& mesh, const std::string& path, int64_t sourceSize, int64_t sourceMtime) {
+    MeshView view = mesh.view();
+    MeshFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, MESH_FILE_MAGIC, sizeof(header.magic));
+    header.version = MESH_FILE_VERSION;
+    header.headerSize = sizeof(MeshFileHeader);
+    header.vertexCount = view.vertexCount;
+    header.triangleCount = view.triangleCount;
+
+    uint64_t offset = alignSection(sizeof(MeshFileHeader));
+    for (int axis = 0; axis < 3; axis++) {
+        header.positionOffset[axis] = offset;
+        offset = alignSection(offset + view.vertexCount * sizeof(float));
+    }
+    header.indexOffset = offset;
+    offset = alignSection(offset + view.triangleCount * 3 * sizeof(uint32_t));
+    header.colorOffset = offset;
+    offset = alignSection(offset + view.triangleCount * sizeof(Color));
+    header.edgeOffset = offset;
+    header.edgeCount = view.edgeCount;
+    header.fileSize = offset + view.edgeCount * sizeof(MeshEdge);
+
+    header.boundsMin[0] = view.boundsMin.x; header.boundsMin[1] = view.boundsMin.y; header.boundsMin[2] = view.boundsMin.z;
+    header.boundsMax[0] = view.boundsMax.x; header.boundsMax[1] = view.boundsMax.y; header.boundsMax[2] = view.boundsMax.z;
+    header.sourceSize = sourceSize;
+    header.sourceMtime = sourceMtime;
+
+    std::string tempPath = path + ".tmp";
+    FILE* file = std::fopen(tempPath.c_str(), "wb");
+    if (!file) return false;
+
+    static const char padding[MESH_SECTION_ALIGN] = {};
+    uint64_t written = 0;
+    bool ok = true;
+    auto writeSection = [&](uint64_t at, const void* data, size_t bytes) {
+        if (ok && at > written) ok = std::fwrite(padding, 1, at - written, file) == at - written;
+        if (ok && bytes) ok = std::fwrite(data, 1, bytes, file) == bytes;
+        written = at + bytes;
+    };
+    writeSection(0, &header, sizeof(header));
+    writeSection(header.positionOffset[0], view.px, view.vertexCount * sizeof(float));
+    writeSection(header.positionOffset[1], view.py, view.vertexCount * sizeof(float));
+    writeSection(header.positionOffset[2], view.pz, view.vertexCount * sizeof(float));
+    writeSection(header.indexOffset, view.indices, view.triangleCount * 3 * sizeof(uint32_t));
+    writeSection(header.colorOffset, view.faceColors, view.triangleCount * sizeof(Color));
+    writeSection(header.edgeOffset, view.edges, view.edgeCount * sizeof(MeshEdge));
+
+    if (std::fclose(file) != 0) ok = false;
+    if (ok) ok = std::rename(tempPath.c_str(), path.c_str()) == 0;
+    if (!ok) std::remove(tempPath.c_str());
+    return ok;
+}
+
+// Wavefront OBJ: positions, optional per-vertex colours ("v x y z r g b"),
+// polygon faces fanned into triangles, and diffuse colours from the
+// material library. Texture coordinates and normals are ignored.
+static bool importObj(const std::string& path, Mesh& mesh) {
+    std::string text;
+    if (!readFile(path, text)) {
+        std::cerr << "Cannot read " << path << std::endl;
+        return false;
+    }
+
+    std::vector<Color> vertexColors;
+    std::unordered_map<std::string, Color> materials;
+    bool hasMaterial = false;
+    Color material = DEFAULT_MESH_COLOR;
+    std::vector<uint32_t> polygon;
+    size_t lineNumber = 0;
+
+    // Material libraries are small, parse them the simple way
+    auto loadMaterials = [&](const std::string& name) {
+        size_t slash = path.find_last_of('/');
+        std::string libPath = (slash == std::string::npos) ? name : path.substr(0, slash + 1) + name;
+        std::string lib;
+        if (!readFile(libPath, lib)) {
+            std::cerr << "Warning: cannot read material library " << libPath << std::endl;
+            return;
+        }
+        std::string current;
+        size_t pos = 0;
+        while (pos < lib.size()) {
+            size_t end = lib.find('\n', pos);
+            if (end == std::string::npos) end = lib.size();
+            std::string line = lib.substr(pos, end - pos);
+            pos = end + 1;
+
+            char name[256];
+            float r, g, b;
+            if (std::sscanf(line.c_str(), " newmtl %255s", name) == 1) {
+                current = name;
+                materials.emplace(current, DEFAULT_MESH_COLOR);
+            } else if (!current.empty() && std::sscanf(line.c_str(), " Kd %f %f %f", &r, &g, &b) == 3) {
+                materials.at(current) = Color(unitToByte(r), unitToByte(g), unitToByte(b));
+            }
+        }
+    };
+
+    char* p = &text[0];
+    char* end = p + text.size();
+    while (p < end) {
+        char* lineEnd = (char*)std::memchr(p, '\n', end - p);
+        if (!lineEnd) lineEnd = end;
+        *lineEnd = '\0';  // Keep strtof and friends on this line
+        char* line = p;
+        p = lineEnd + 1;
+        lineNumber++;
+
+        while (*line == ' ' || *line == '\t') line++;
+        if (line[0] == 'v' && (line[1] == ' ' || line[1] == '\t')) {
+            char* cursor = line + 2;
+            float v[6];
+            int count = 0;
+            for (; count < 6; count++) {
+                char* next;
+                v[count] = std::strtof(cursor, &next);
+                if (next == cursor) break;
+                cursor = next;
+            }
+            if (count < 3) {
+                std::cerr << path << ":" << lineNumber << ": malformed vertex" << std::endl;
+                return false;
+            }
+            mesh.addVertex(Vec3(v[0], v[1], v[2]));
+            if (count == 6) {
+                vertexColors.resize(mesh.vertexCount() - 1, DEFAULT_MESH_COLOR);
+                vertexColors.push_back(Color(unitToByte(v[3]), unitToByte(v[4]), unitToByte(v[5])));
+            }
+        } else if (line[0] == 'f' && (line[1] == ' ' || line[1] == '\t')) {
+            polygon.clear();
+            char* cursor = line + 2;
+            while (true) {
+                char* next;
+                long index = std::strtol(cursor, &next, 10);
+                if (next == cursor) break;
+                // Only the position index matters in v/vt/vn
+                while (*next && *next != ' ' && *next != '\t' && *next != '\r') next++;
+                cursor = next;
+
+                long resolved = index > 0 ? index - 1 : (long)mesh.vertexCount() + index;
+                if (index == 0 || resolved < 0 || resolved >= (long)mesh.vertexCount()) {
+                    std::cerr << path << ":" << lineNumber << ": face references missing vertex " << index << std::endl;
+                    return false;
+                }
+                polygon.push_back((uint32_t)resolved);
+            }
+
+            for (size_t i = 2; i < polygon.size(); i++) {
+                Color color = material;
+                if (!hasMaterial && !vertexColors.empty()) {
+                    int sum[3] = {0, 0, 0};
+                    for (uint32_t v : {polygon[0], polygon[i - 1], polygon[i]}) {
+                        const Color& c = v < vertexColors.size() ? vertexColors[v] : DEFAULT_MESH_COLOR;
+                        sum[0] += c.r; sum[1] += c.g; sum[2] += c.b;
+                    }
+                    color = Color((uint8_t)(sum[0] / 3), (uint8_t)(sum[1] / 3), (uint8_t)(sum[2] / 3));
+                }
+                mesh.addTriangle(polygon[0], polygon[i - 1], polygon[i], color);
+            }
+        } else if (std::strncmp(line, "usemtl", 6) == 0 || std::strncmp(line, "mtllib", 6) == 0) {
+            char name[256];
+            if (std::sscanf(line + 6, " %255s", name) != 1) continue;
+            if (line[0] == 'm') {
+                loadMaterials(name);
+            } else {
+                auto it = materials.find(name);
+                hasMaterial = it != materials.end();
+                material = hasMaterial ? it->second : DEFAULT_MESH_COLOR;
+            }
+        }
+    }
+    return true;
+}
+
+enum PlyType { PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16, PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64, PLY_INVALID };
+enum PlyFormat { PLY_ASCII, PLY_BINARY_LE, PLY_BINARY_BE };
+
+struct PlyProperty {
+    std::string name;
+    PlyType type;
+    PlyType countType;      // For lists, PLY_INVALID otherwise
+};
+
+struct PlyElement {
+    std::string name;
+    size_t count;
+    std::vector<PlyProperty> properties;
+
+    int find(const char* property) const {
+        for (size_t i = 0; i < properties.size(); i++) {
+            if (properties[i].name == property) return (int)i;
+        }
+        return -1;
+    }
+};
+
+static PlyType plyType(const std::string& name) {
+    if (name == "char" || name == "int8") return PLY_INT8;
+    if (name == "uchar" || name == "uint8") return PLY_UINT8;
+    if (name == "short" || name == "int16") return PLY_INT16;
+    if (name == "ushort" || name == "uint16") return PLY_UINT16;
+    if (name == "int" || name == "int32") return PLY_INT32;
+    if (name == "uint" || name == "uint32") return PLY_UINT32;
+    if (name == "float" || name == "float32") return PLY_FLOAT32;
+    if (name == "double" || name == "float64") return PLY_FLOAT64;
+    return PLY_INVALID;
+}
+
+// Reads scalar values from a PLY body in any of the three encodings
+class PlyReader {
+private:
+    const char* cursor;
+    const char* end;
+    PlyFormat format;
+
+    template<typename T>
+    T readBinary() {
+        T value;
+        if (end - cursor < (ptrdiff_t)sizeof(T)) {
+            ok = false;
+            return 0;
+        }
+        char bytes[sizeof(T)];
+        std::memcpy(bytes, cursor, sizeof(T));
+        cursor += sizeof(T);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        if (format == PLY_BINARY_BE) std::reverse(bytes, bytes + sizeof(T));
+#else
+        if (format == PLY_BINARY_LE) std::reverse(bytes, bytes + sizeof(T));
+#endif
+        std::memcpy(&value, bytes, sizeof(T));
+        return value;
+    }
+
+public:
+    bool ok;
+
+    PlyReader(const char* begin, const char* end, PlyFormat format)
+        : cursor(begin), end(end), format(format), ok(true) {}
+
+    double read(PlyType type) {
+        if (format == PLY_ASCII) {
+            char* next;
+            double value = std::strtod(cursor, &next);
+            if (next == cursor) ok = false;
+            cursor = next;
+            return value;
+        }
+        switch (type) {
+            case PLY_INT8:    return readBinary<int8_t>();
+            case PLY_UINT8:   return readBinary<uint8_t>();
+            case PLY_INT16:   return readBinary<int16_t>();
+            case PLY_UINT16:  return readBinary<uint16_t>();
+            case PLY_INT32:   return readBinary<int32_t>();
+            case PLY_UINT32:  return readBinary<uint32_t>();
+            case PLY_FLOAT32: return readBinary<float>();
+            case PLY_FLOAT64: return readBinary<double>();
+            default:          ok = false; return 0;
+        }
+    }
+};
+
+// A list length or vertex index: integral and in uint32_t range, which
+// also rules out the NaNs and infinities an ASCII body can spell
+static bool isPlyIndex(double value) {
+    return value >= 0 && value <= UINT32_MAX && value == std::floor(value);
+}
+
+// A colour channel already scaled to 0-255; out of range values saturate
+static uint8_t plyChannel(double value) {
+    return value > 0 ? (uint8_t)std::min(255.0, value) : 0;
+}
+
+// Stanford PLY in ASCII or binary: vertex positions with optional colours,
+// polygon faces fanned into triangles with optional per-face colours.
+// Other elements are skipped.
+static bool importPly(const std::string& path, Mesh& mesh) {
+    std::string data;
+    if (!readFile(path, data)) {
+        std::cerr << "Cannot read " << path << std::endl;
+        return false;
+    }
+
+    PlyFormat format = PLY_ASCII;
+    std::vector<PlyElement> elements;
+    size_t pos = 0;
+    bool headerDone = false;
+    while (!headerDone && pos < data.size()) {
+        size_t lineEnd = data.find('\n', pos);
+        if (lineEnd == std::string::npos) break;
+        std::string line = data.substr(pos, lineEnd - pos);
+        pos = lineEnd + 1;
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+
+        char a[64], b[64], c[64], d[64];
+        unsigned long count;
+        if (line == "end_header") {
+            headerDone = true;
+        } else if (std::sscanf(line.c_str(), "format %63s", a) == 1) {
+            std::string f = a;
+            if (f == "ascii") format = PLY_ASCII;
+            else if (f == "binary_little_endian") format = PLY_BINARY_LE;
+            else if (f == "binary_big_endian") format = PLY_BINARY_BE;
+            else break;
+        } else if (std::sscanf(line.c_str(), "element %63s %lu", a, &count) == 2) {
+            elements.push_back({a, (size_t)count, {}});
+        } else if (std::sscanf(line.c_str(), "property list %63s %63s %63s", a, b, c) == 3 && !elements.empty()) {
+            elements.back().properties.push_back({c, plyType(b), plyType(a)});
+        } else if (std::sscanf(line.c_str(), "property %63s %63s", a, d) == 2 && !elements.empty()) {
+            elements.back().properties.push_back({d, plyType(a), PLY_INVALID});
+        }
+    }
+    if (data.compare(0, 3, "ply") != 0 || !headerDone) {
+        std::cerr << path << ": not a PLY file" << std::endl;
+        return false;
+    }
+    for (const PlyElement& element : elements) {
+        for (const PlyProperty& property : element.properties) {
+            if (property.type == PLY_INVALID) {
+                std::cerr << path << ": unknown type for property " << property.name << std::endl;
+                return false;
+            }
+        }
+    }
+
+    PlyReader reader(data.c_str() + pos, data.c_str() + data.size(), format);
+    std::vector<Color> vertexColors;
+    std::vector<double> values;
+    std::vector<uint32_t> polygon;
+
+    for (const PlyElement& element : elements) {
+        int x = element.find("x"), y = element.find("y"), z = element.find("z");
+        int red = element.find("red"), green = element.find("green"), blue = element.find("blue");
+        int list = element.find("vertex_indices");
+        if (list < 0) list = element.find("vertex_index");
+        bool isVertex = element.name == "vertex" && x >= 0 && y >= 0 && z >= 0;
+        bool isFace = element.name == "face" && list >= 0;
+        bool hasColor = red >= 0 && green >= 0 && blue >= 0;
+        // Integer colours are 0-255, float ones 0-1
+        double colorScale = hasColor && element.properties[red].type >= PLY_FLOAT32 ? 255.0 : 1.0;
+        if (isVertex && hasColor) vertexColors.reserve(element.count);
+
+        values.resize(element.properties.size());
+        for (size_t item = 0; item < element.count && reader.ok; item++) {
+            polygon.clear();
+            for (size_t i = 0; i < element.properties.size(); i++) {
+                const PlyProperty& property = element.properties[i];
+                if (property.countType == PLY_INVALID) {
+                    values[i] = reader.read(property.type);
+                    continue;
+                }
+                // Counts and indices are checked before conversion; malformed
+                // ones would not fit the unsigned types
+                double length = reader.read(property.countType);
+                if (!isPlyIndex(length)) {
+                    std::cerr << path << ": invalid list length " << length << std::endl;
+                    return false;
+                }
+                for (uint32_t k = 0; k < (uint32_t)length && reader.ok; k++) {
+                    double index = reader.read(property.type);
+                    if ((int)i != list) continue;
+                    if (!isPlyIndex(index)) {
+                        std::cerr << path << ": invalid vertex index " << index << std::endl;
+                        return false;
+                    }
+                    polygon.push_back((uint32_t)index);
+                }
+            }
+            if (!reader.ok) break;
+
+            if (isVertex) {
+                mesh.addVertex(Vec3((float)values[x], (float)values[y], (float)values[z]));
+                if (hasColor) {
+                    vertexColors.push_back(Color(plyChannel(values[red] * colorScale),
+                                                 plyChannel(values[green] * colorScale),
+                                                 plyChannel(values[blue] * colorScale)));
+                }
+            } else if (isFace) {
+                for (uint32_t v : polygon) {
+                    if (v >= mesh.vertexCount()) {
+                        std::cerr << path << ": face references missing vertex " << v << std::endl;
+                        return false;
+                    }
+                }
+                for (size_t i = 2; i < polygon.size(); i++) {
+                    Color color = DEFAULT_MESH_COLOR;
+                    if (hasColor) {
+                        color = Color(plyChannel(values[red] * colorScale),
+                                      plyChannel(values[green] * colorScale),
+                                      plyChannel(values[blue] * colorScale));
+                    } else if (!vertexColors.empty()) {
+                        int sum[3] = {0, 0, 0};
+                        for (uint32_t v : {polygon[0], polygon[i - 1], polygon[i]}) {
+                            sum[0] += vertexColors[v].r; sum[1] += vertexColors[v].g; sum[2] += vertexColors[v].b;
+                        }
+                        color = Color((uint8_t)(sum[0] / 3), (uint8_t)(sum[1] / 3), (uint8_t)(sum[2] / 3));
+                    }
+                    mesh.addTriangle(polygon[0], polygon[i - 1], polygon[i], color);
+                }
+            }
+        }
+        if (!reader.ok) {
+            std::cerr << path << ": truncated or malformed " << element.name << " data" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// A mesh ready to draw. Binary mesh files are mapped and used in place;
+// OBJ and PLY files are imported once and cached next to the source as a
+// binary mesh, so later runs only map the cache. If the cache cannot be
+// written the imported mesh is drawn from memory.
+class MeshAsset {
+private:
+    Mesh imported;
+    void* mapping;
+    size_t mappingSize;
+    MeshView meshView;
+
+    void unmap() {
+        if (mapping) munmap(mapping, mappingSize);
+        mapping = nullptr;
+        mappingSize = 0;
+    }
+
+    // Map a binary mesh file. With a source stat, the file must have been
+    // imported from exactly that source.
+    bool mapFile(const std::string& path, const struct stat* source, bool quiet) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            if (!quiet) std::cerr << "Cannot open " << path << std::endl;
+            return false;
+        }
+        struct stat st;
+        void* data = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(MeshFileHeader)) {
+            data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (data == MAP_FAILED) {
+            if (!quiet) std::cerr << path << ": not a mesh file" << std::endl;
+            return false;
+        }
+
+        const MeshFileHeader& header = *(const MeshFileHeader*)data;
+        uint64_t size = st.st_size;
+        auto fits = [&](uint64_t offset, uint64_t count, uint64_t elementSize) {
+            return offset % MESH_SECTION_ALIGN == 0 && offset <= size && count <= (size - offset) / elementSize;
+        };
+        bool valid = std::memcmp(header.magic, MESH_FILE_MAGIC, sizeof(header.magic)) == 0 &&
+                     header.version == MESH_FILE_VERSION && header.headerSize == sizeof(MeshFileHeader) &&
+                     header.fileSize == size && header.vertexCount <= UINT32_MAX &&
+                     fits(header.positionOffset[0], header.vertexCount, sizeof(float)) &&
+                     fits(header.positionOffset[1], header.vertexCount, sizeof(float)) &&
+                     fits(header.positionOffset[2], header.vertexCount, sizeof(float)) &&
+                     fits(header.indexOffset, header.triangleCount, 3 * sizeof(uint32_t)) &&
+                     fits(header.colorOffset, header.triangleCount, sizeof(Color)) &&
+                     fits(header.edgeOffset, header.edgeCount, sizeof(MeshEdge));
+        if (valid && source) {
+            valid = header.sourceSize == (int64_t)source->st_size && header.sourceMtime == (int64_t)source->st_mtime;
+        }
+
+        // Start paging in the arrays while the rest of startup runs
+        if (valid) madvise(data, st.st_size, MADV_WILLNEED);
+
+        // A cache was checked when this tool imported it, and the source
+        // stat ties it to that import; a file handed straight to --mesh
+        // could hold anything, so its indices and edges are range checked
+        if (valid && !source) {
+            const uint32_t* indices = (const uint32_t*)((const char*)data + header.indexOffset);
+            uint64_t indexCount = header.triangleCount * 3;
+            for (uint64_t i = 0; i < indexCount && valid; i++) valid = indices[i] < header.vertexCount;
+            const MeshEdge* edges = (const MeshEdge*)((const char*)data + header.edgeOffset);
+            for (uint64_t i = 0; i < header.edgeCount && valid; i++) {
+                const MeshEdge& edge = edges[i];
+                valid = edge.v0 < header.vertexCount && edge.v1 < header.vertexCount &&
+                        edge.faces[0] < header.triangleCount &&
+                        (edge.faces[1] < header.triangleCount || edge.faces[1] == NO_FACE);
+            }
+        }
+        if (!valid) {
+            if (!quiet) std::cerr << path << ": not a valid mesh file" << std::endl;
+            munmap(data, st.st_size);
+            return false;
+        }
+
+        unmap();
+        mapping = data;
+        mappingSize = st.st_size;
+        const char* base = (const char*)data;
+        meshView.px = (const float*)(base + header.positionOffset[0]);
+        meshView.py = (const float*)(base + header.positionOffset[1]);
+        meshView.pz = (const float*)(base + header.positionOffset[2]);
+        meshView.indices = (const uint32_t*)(base + header.indexOffset);
+        meshView.faceColors = (const Color*)(base + header.colorOffset);
+        meshView.vertexCount = header.vertexCount;
+        meshView.triangleCount = header.triangleCount;
+        meshView.boundsMin = Vec3(header.boundsMin[0], header.boundsMin[1], header.boundsMin[2]);
+        meshView.boundsMax = Vec3(header.boundsMax[0], header.boundsMax[1], header.boundsMax[2]);
+        meshView.edges = header.edgeCount ? (const MeshEdge*)(base + header.edgeOffset) : nullptr;
+        meshView.edgeCount = header.edgeCount;
+        meshView.texU = meshView.texV = nullptr;
+        meshView.texturedFaces = nullptr;
+        return true;
+    }
+
+public:
+    MeshAsset() : mapping(nullptr), mappingSize(0), meshView() {}
+    ~MeshAsset() { unmap(); }
+
+    MeshAsset(const MeshAsset&) = delete;
+    MeshAsset& operator=(const MeshAsset&) = delete;
+
+    bool load(const std::string& path) {
+        std::string ext = lowercaseExtension(path);
+        if (ext == MESH_FILE_EXTENSION) return mapFile(path, nullptr, false);
+        if (ext != ".obj" && ext != ".ply") {
+            std::cerr << "Unsupported mesh format: " << path << " (expected .obj, .ply or "
+                      << MESH_FILE_EXTENSION << ")" << std::endl;
+            return false;
+        }
+
+        struct stat source;
+        if (stat(path.c_str(), &source) != 0) {
+            std::cerr << "Cannot open " << path << std::endl;
+            return false;
+        }
+        std::string cachePath = path + MESH_FILE_EXTENSION;
+        if (mapFile(cachePath, &source, true)) return true;
+
+        std::cout << "Importing " << path << "..." << std::endl;
+        imported = Mesh();
+        if (!(ext == ".obj" ? importObj(path, imported) : importPly(path, imported))) return false;
+        if (imported.vertexCount() > UINT32_MAX) {
+            std::cerr << path << ": too many vertices" << std::endl;
+            return false;
+        }
+        imported.buildEdges();
+
+        if (writeMeshFile(imported, cachePath, source.st_size, source.st_mtime) &&
+            mapFile(cachePath, &source, true)) {
+            imported = Mesh();
+            return true;
+        }
+        std::cerr << "Warning: cannot write mesh cache " << cachePath << ", using the imported mesh" << std::endl;
+        meshView = imported.view();
+        return true;
+    }
+
+    const MeshView& view() const { return meshView; }
+};
+
+// ============================================================================
+// Video Encoder
+// ============================================================================
+
+enum ConverterKind { CONVERTER_BUILTIN, CONVERTER_SWSCALE };
+
+// FILE picks the muxer from the output's extension and writes its index at
+// the end, so it needs a seekable file. The others can be written to a pipe
+// as frames are encoded; Y4M and NUT carry the frames unencoded.
+enum OutputContainer { CONTAINER_FILE, CONTAINER_FRAGMENTED_MP4, CONTAINER_MPEGTS, CONTAINER_Y4M, CONTAINER_NUT };
+
+// Output geometry and timing of a job
+struct VideoFormat {
+    int width, height;
+    int fps;
+    int duration;       // Seconds
+
+    VideoFormat() : width(1920), height(1080), fps(30), duration(5) {}
+
+    int totalFrames() const { return fps * duration; }
+    float aspect() const { return (float)width / (float)height; }
+};
+
+// Named x264 trade-offs between speed, size and latency
+enum EncoderProfileId { PROFILE_DRAFT, PROFILE_BALANCED, PROFILE_ARCHIVAL, PROFILE_LOW_LATENCY };
+
+struct EncoderProfile {
+    const char* name;
+    const char* preset;
+    const char* tune;       // nullptr for none
+    const char* crf;
+    float gopSeconds;       // Keyframe interval, 0 for the settings' gopSize
+    int maxBFrames;
+    int lookahead;          // Frames of rate control lookahead, -1 for the preset's
+    bool sliceThreads;      // Slice threads add no latency but scale worse than frame threads
+    float threadShare;      // Part of the thread budget the codec gets, the rest renders
+};
+
+static const EncoderProfile ENCODER_PROFILES[] = {
+    {"draft", "veryfast", nullptr, "28", 2.0f, 0, 10, false, 0.25f},
+    {"balanced", "medium", nullptr, "23", 0.0f, 1, -1, false, 0.5f},
+    {"archival", "slow", nullptr, "18", 4.0f, 3, 60, false, 0.75f},
+    {"low-latency", "veryfast", "zerolatency", "23", 1.0f, 0, 0, true, 0.5f},
+};
+
+struct EncoderSettings {
+    VideoFormat format;
+    ConverterKind converter;
+    ColorMatrix matrix;
+    int gopSize;
+    bool closedGop;     // Every GOP decodable on its own, required for segment concat
+    OutputContainer container;
+    EncoderProfileId profile;
+    int threads;        // Codec threads, 0 for libavcodec's choice
+
+    EncoderSettings() : converter(CONVERTER_BUILTIN), matrix(COLOR_MATRIX_BT601), gopSize(10), closedGop(false),
+                        container(CONTAINER_FILE), profile(PROFILE_BALANCED), threads(0) {}
+
+    bool passthrough() const { return container == CONTAINER_Y4M || container == CONTAINER_NUT; }
+    const EncoderProfile& profileInfo() const { return ENCODER_PROFILES[profile]; }
+
+    // Frames per GOP, which segments are aligned to
+    int gop() const {
+        float seconds = profileInfo().gopSeconds;
+        return seconds > 0.0f ? std::max(1, (int)std::lround(seconds * format.fps)) : gopSize;
+    }
+};
+
+// Looked up once per process rather than once per clip
+static const AVCodec* h264Encoder() {
+    static const AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+    return codec;
+}
+
+// Y4M takes references to the frames themselves; NUT stores raw planes
+static const AVCodec* passthroughEncoder(OutputContainer container) {
+    static const AVCodec* wrapped = avcodec_find_encoder(AV_CODEC_ID_WRAPPED_AVFRAME);
+    static const AVCodec* raw = avcodec_find_encoder(AV_CODEC_ID_RAWVIDEO);
+    return container == CONTAINER_Y4M ? wrapped : raw;
+}
+
+static const char* containerMuxer(OutputContainer container) {
+    switch (container) {
+    case CONTAINER_FRAGMENTED_MP4: return "mp4";
+    case CONTAINER_MPEGTS: return "mpegts";
+    case CONTAINER_Y4M: return "yuv4mpegpipe";
+    case CONTAINER_NUT: return "nut";
+    default: return nullptr;
+    }
+}
+
+class VideoEncoder {
+private:
+    AVFormatContext* fmtCtx;
+    AVCodecContext* codecCtx;
     AVStream* stream;
-    AVFrame* frame;
     AVPacket* pkt;
     SwsContext* swsCtx;
+    bool ownsSwsCtx;
+    int frameCount;
+    EncoderSettings settings;
+    YuvConverter converter;
+
+    void writePacket(AVPacket* packet) {
+        StageTimer timer(STAGE_MUX);
+        av_packet_rescale_ts(packet, codecCtx->time_base, stream->time_base);
+        packet->stream_index = stream->index;
+        telemetry.bytesMuxed += packet->size;
+        av_interleaved_write_frame(fmtCtx, packet);
+        av_packet_unref(packet);
+    }
+    
+public:
+    VideoEncoder() : fmtCtx(nullptr), codecCtx(nullptr), stream(nullptr),
+                     pkt(nullptr), swsCtx(nullptr), ownsSwsCtx(false), frameCount(0) {}
+    
+    // sharedScaler, if given, is a swscale context set up for this format
+    // and matrix that outlives the encoder; otherwise one is created. A
+    // filename of - writes to stdout, as fragmented MP4 unless a streaming
+    // container was chosen.
+    bool init(const char* filename, const EncoderSettings& encoderSettings = EncoderSettings(),
+              ThreadPool* pool = nullptr, SwsContext* sharedScaler = nullptr) {
+        settings = encoderSettings;
+        converter = YuvConverter(settings.matrix, pool);
+
+        bool toStdout = std::strcmp(filename, "-") == 0;
+        if (toStdout) {
+            filename = "pipe:1";
+            if (settings.container == CONTAINER_FILE) settings.container = CONTAINER_FRAGMENTED_MP4;
+        }
+        avformat_alloc_output_context2(&fmtCtx, nullptr, containerMuxer(settings.container), filename);
+        if (!fmtCtx) return false;
+        
+        const AVCodec* codec = settings.passthrough() ? passthroughEncoder(settings.container) : h264Encoder();
+        if (!codec) return false;
+        
+        stream = avformat_new_stream(fmtCtx, nullptr);
+        if (!stream) return false;
+        
+        codecCtx = avcodec_alloc_context3(codec);
+        if (!codecCtx) return false;
+        
+        const VideoFormat& format = settings.format;
+        codecCtx->width = format.width;
+        codecCtx->height = format.height;
+        codecCtx->time_base = {1, format.fps};
+        codecCtx->framerate = {format.fps, 1};
+        codecCtx->pix_fmt = AV_PIX_FMT_YUV420P;
+        const EncoderProfile& profile = settings.profileInfo();
+        codecCtx->gop_size = settings.gop();
+        codecCtx->max_b_frames = profile.maxBFrames;
+        codecCtx->thread_count = settings.threads;
+        codecCtx->thread_type = profile.sliceThreads ? FF_THREAD_SLICE : FF_THREAD_FRAME;
+        if (settings.closedGop) codecCtx->flags |= AV_CODEC_FLAG_CLOSED_GOP;
+        
+        // MP4 wants SPS/PPS in the container header rather than in-band
+        if (fmtCtx->oformat->flags & AVFMT_GLOBALHEADER) codecCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+        // Tag the stream with the matrix the frames are converted with
+        bool bt709 = settings.matrix == COLOR_MATRIX_BT709;
+        codecCtx->colorspace = bt709 ? AVCOL_SPC_BT709 : AVCOL_SPC_SMPTE170M;
+        codecCtx->color_primaries = bt709 ? AVCOL_PRI_BT709 : AVCOL_PRI_SMPTE170M;
+        codecCtx->color_trc = bt709 ? AVCOL_TRC_BT709 : AVCOL_TRC_SMPTE170M;
+        codecCtx->color_range = AVCOL_RANGE_MPEG;
+        
+        if (!settings.passthrough()) {
+            av_opt_set(codecCtx->priv_data, "preset", profile.preset, 0);
+            if (profile.tune) av_opt_set(codecCtx->priv_data, "tune", profile.tune, 0);
+            av_opt_set(codecCtx->priv_data, "crf", profile.crf, 0);
+            if (profile.lookahead >= 0) av_opt_set_int(codecCtx->priv_data, "rc-lookahead", profile.lookahead, 0);
+        }
+        
+        if (avcodec_open2(codecCtx, codec, nullptr) < 0) return false;
+        
+        avcodec_parameters_from_context(stream->codecpar, codecCtx);
+        // Y4M states its frame rate from the stream time base
+        if (settings.passthrough()) stream->time_base = codecCtx->time_base;
+        
+        if (!(fmtCtx->oformat->flags & AVFMT_NOFILE)) {
+            if (avio_open(&fmtCtx->pb, filename, AVIO_FLAG_WRITE) < 0) return false;
+        }
+        
+        // Streamed output goes out packet by packet so a reader can start at
+        // once; fragmented MP4 opens with an empty index and a fragment per GOP
+        AVDictionary* muxerOptions = nullptr;
+        if (settings.container != CONTAINER_FILE) av_dict_set(&muxerOptions, "flush_packets", "1", 0);
+        if (settings.container == CONTAINER_FRAGMENTED_MP4) {
+            av_dict_set(&muxerOptions, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+        }
+        int written = avformat_write_header(fmtCtx, &muxerOptions);
+        av_dict_free(&muxerOptions);
+        if (written < 0) return false;
+        
+        pkt = av_packet_alloc();
+        
+        if (settings.converter == CONVERTER_SWSCALE && sharedScaler) {
+            swsCtx = sharedScaler;
+        } else if (settings.converter == CONVERTER_SWSCALE) {
+            ownsSwsCtx = true;
+            swsCtx = sws_getContext(
+                format.width, format.height, AV_PIX_FMT_RGBA,
+                format.width, format.height, AV_PIX_FMT_YUV420P,
+                SWS_BILINEAR, nullptr, nullptr, nullptr
+            );
+            if (!swsCtx) return false;
+
+            const int* coefficients = sws_getCoefficients(bt709 ? SWS_CS_ITU709 : SWS_CS_ITU601);
+            sws_setColorspaceDetails(swsCtx, coefficients, 1, coefficients, 0, 0, 1 << 16, 1 << 16);
+        }
+        
+        return true;
+    }
+    
+    // A frame with the encoder's format to render or convert into. Call
+    // av_frame_make_writable before refilling it, as the encoder may still
+    // reference its buffers. The caller frees it with av_frame_free.
+    AVFrame* allocFrame() const {
+        AVFrame* extra = av_frame_alloc();
+        if (!extra) return nullptr;
+        extra->format = codecCtx->pix_fmt;
+        extra->width = codecCtx->width;
+        extra->height = codecCtx->height;
+        if (av_frame_get_buffer(extra, 0) < 0) av_frame_free(&extra);
+        return extra;
+    }
+
+    // Convert an RGBA framebuffer into dst. Only one thread may convert at a
+    // time. dstDrawn holds the drawn bounds of the framebuffer dst was last
+    // converted from, or the whole frame if none; only rows drawn in either
+    // frame can differ, the rest already hold the background. swscale
+    // always converts the whole frame, as its slices must start at the top.
+    void convertFrame(const Framebuffer& fb, AVFrame* dst, Rect& dstDrawn) {
+        // Color is packed RGBA, so the framebuffer feeds the converter directly
+        const uint8_t* rgba = reinterpret_cast<const uint8_t*>(fb.getData());
+        int width = fb.getWidth(), height = fb.getHeight();
+        int rgbaStride = width * (int)sizeof(Color);
+        Rect changed = dstDrawn.united(fb.getDrawn());
+        dstDrawn = fb.getDrawn();
+
+        av_frame_make_writable(dst);
+        
+        // Convert RGBA to YUV420P
+        if (settings.converter == CONVERTER_SWSCALE) {
+            const uint8_t* srcData[4] = { rgba, nullptr, nullptr, nullptr };
+            int srcLinesize[4] = { rgbaStride, 0, 0, 0 };
+            sws_scale(swsCtx, srcData, srcLinesize, 0, height, dst->data, dst->linesize);
+        } else if (!changed.empty()) {
+            // Whole row pairs, so each chroma row is written from both its luma rows
+            int y0 = changed.y0 & ~1, y1 = std::min(height, (changed.y1 + 1) & ~1);
+            uint8_t* planes[3] = {dst->data[0] + (size_t)y0 * dst->linesize[0],
+                                  dst->data[1] + (size_t)(y0 / 2) * dst->linesize[1],
+                                  dst->data[2] + (size_t)(y0 / 2) * dst->linesize[2]};
+            converter.convert(rgba + (size_t)y0 * rgbaStride, rgbaStride, width, y1 - y0, planes, dst->linesize);
+        }
+    }
+
+    const VideoFormat& getFormat() const { return settings.format; }
+
+    // Send a converted frame to the codec and mux whatever packets come out.
+    // Frames are timestamped in the order they are sent.
+    void encodeFrame(AVFrame* src) {
+        src->pts = frameCount++;
+        
+        avcodec_send_frame(codecCtx, src);
+        
+        while (avcodec_receive_packet(codecCtx, pkt) == 0) {
+            writePacket(pkt);
+        }
+    }
+    
+    void finish() {
+        avcodec_send_frame(codecCtx, nullptr);
+        
+        AVPacket* pkt = av_packet_alloc();
+        while (avcodec_receive_packet(codecCtx, pkt) == 0) {
+            writePacket(pkt);
+        }
+        av_packet_free(&pkt);
+        
+        av_write_trailer(fmtCtx);
+        
+        avcodec_free_context(&codecCtx);
+        av_packet_free(&this->pkt);
+        if (swsCtx && ownsSwsCtx) sws_freeContext(swsCtx);
+        
+        if (!(fmtCtx->oformat->flags & AVFMT_NOFILE)) {
+            avio_closep(&fmtCtx->pb);
+        }
+        
+        avformat_free_context(fmtCtx);
+    }
+};
+
+// ============================================================================
+// Texture Sources
+// ============================================================================
+
+// Largest texture side; bigger sources are scaled down to it
+static const int MAX_TEXTURE_SIZE = 1024;
+
+// Decodes an image or video file frame by frame and scales frames into a
+// texture. Stills are one-frame streams to libavformat, so both take this path.
+class TextureDecoder {
+private:
+    AVFormatContext* input;
+    AVCodecContext* codec;
+    SwsContext* scaler;
+    AVFrame* frame;         // The last frame decoded
+    AVFrame* pending;
+    AVPacket* packet;
+    int streamIndex;
+    bool draining;          // Input exhausted, the decoder is flushing
+    std::vector<uint8_t> rgba;
+
+public:
+    TextureDecoder() : input(nullptr), codec(nullptr), scaler(nullptr), frame(nullptr), pending(nullptr), packet(nullptr),
+                       streamIndex(-1), draining(false) {}
+    ~TextureDecoder() { close(); }
+
+    bool open(const std::string& path) {
+        close();
+        if (avformat_open_input(&input, path.c_str(), nullptr, nullptr) < 0) {
+            std::cerr << "Cannot open " << path << std::endl;
+            return false;
+        }
+        if (avformat_find_stream_info(input, nullptr) >= 0) {
+            streamIndex = av_find_best_stream(input, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+        }
+        if (streamIndex < 0) {
+            std::cerr << "No video stream in " << path << std::endl;
+            close();
+            return false;
+        }
+
+        const AVCodecParameters* parameters = input->streams[streamIndex]->codecpar;
+        const AVCodec* decoder = avcodec_find_decoder(parameters->codec_id);
+        codec = decoder ? avcodec_alloc_context3(decoder) : nullptr;
+        if (!codec || avcodec_parameters_to_context(codec, parameters) < 0 || avcodec_open2(codec, decoder, nullptr) < 0) {
+            std::cerr << "Cannot decode " << path << std::endl;
+            close();
+            return false;
+        }
+        frame = av_frame_alloc();
+        pending = av_frame_alloc();
+        packet = av_packet_alloc();
+        return frame && pending && packet;
+    }
+
+    void close() {
+        if (input) avformat_close_input(&input);
+        if (codec) avcodec_free_context(&codec);
+        if (scaler) sws_freeContext(scaler);
+        if (frame) av_frame_free(&frame);
+        if (pending) av_frame_free(&pending);
+        if (packet) av_packet_free(&packet);
+        scaler = nullptr;
+        streamIndex = -1;
+        draining = false;
+    }
+
+    const AVStream* stream() const { return input->streams[streamIndex]; }
+
+    // Packets of the video stream left in the input, read without decoding
+    int countPackets() {
+        int count = 0;
+        while (av_read_frame(input, packet) >= 0) {
+            if (packet->stream_index == streamIndex) count++;
+            av_packet_unref(packet);
+        }
+        return count;
+    }
+
+    // Decode the next frame. False at the end of the stream or on an error,
+    // which keeps the last frame decoded.
+    bool next() {
+        while (true) {
+            int ret = avcodec_receive_frame(codec, pending);
+            if (ret >= 0) {
+                av_frame_unref(frame);
+                av_frame_move_ref(frame, pending);
+                return true;
+            }
+            if (ret != AVERROR(EAGAIN) || draining) return false;
+
+            // Feed the decoder the stream's next packet, or the flush at the end
+            while (true) {
+                if (av_read_frame(input, packet) < 0) {
+                    draining = true;
+                    avcodec_send_packet(codec, nullptr);
+                    break;
+                }
+                if (packet->stream_index != streamIndex) {
+                    av_packet_unref(packet);
+                    continue;
+                }
+                ret = avcodec_send_packet(codec, packet);
+                av_packet_unref(packet);
+                if (ret < 0) return false;
+                break;
+            }
+        }
+    }
+
+    // Scale the last frame decoded to the texture's size and upload it,
+    // transparent parts over the backdrop
+    bool upload(Texture& texture, const Color& backdrop) {
+        int width = texture.getWidth(), height = texture.getHeight();
+        scaler = sws_getCachedContext(scaler, frame->width, frame->height, (AVPixelFormat)frame->format, width, height,
+                                      AV_PIX_FMT_RGBA, SWS_BILINEAR, nullptr, nullptr, nullptr);
+        if (!scaler) return false;
+
+        rgba.resize((size_t)width * height * 4);
+        uint8_t* dst[1] = {rgba.data()};
+        int dstStride[1] = {width * 4};
+        sws_scale(scaler, frame->data, frame->linesize, 0, frame->height, dst, dstStride);
+        for (size_t i = 0; i < rgba.size(); i += 4) {
+            int alpha = rgba[i + 3];
+            if (alpha == 255) continue;
+            rgba[i] = (uint8_t)((rgba[i] * alpha + backdrop.r * (255 - alpha) + 127) / 255);
+            rgba[i + 1] = (uint8_t)((rgba[i + 1] * alpha + backdrop.g * (255 - alpha) + 127) / 255);
+            rgba[i + 2] = (uint8_t)((rgba[i + 2] * alpha + backdrop.b * (255 - alpha) + 127) / 255);
+            rgba[i + 3] = 255;
+        }
+        texture.upload(rgba.data(), width * 4);
+        return true;
+    }
+};
+
+// An image or clip for the phone's screen, probed once per job. Everything
+// about it that frames depend on is fixed here, so a frame's screen content
+// is a pure function of its number; ScreenPlayer does the decoding.
+struct ScreenClip {
+    std::string path;
+    int64_t fileSize, fileMtime;    // With the path, identify the content for frame cache keys
+    int width, height;              // Texture size: powers of two within the source, up to MAX_TEXTURE_SIZE
     int frameCount;
+    double frameRate;               // Clip frames per second, 0 for a still
+    int fps;                        // Output frames per second
+
+    bool probe(const std::string& file, int outputFps) {
+        struct stat st;
+        if (stat(file.c_str(), &st) != 0) {
+            std::cerr << "Cannot open " << file << ": " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        TextureDecoder decoder;
+        if (!decoder.open(file)) return false;
+
+        const AVStream* stream = decoder.stream();
+        const AVCodecParameters* parameters = stream->codecpar;
+        if (parameters->width <= 0 || parameters->height <= 0) {
+            std::cerr << "No picture size in " << file << std::endl;
+            return false;
+        }
+        path = file;
+        fileSize = st.st_size;
+        fileMtime = st.st_mtime;
+        width = floorPowerOfTwo(std::min(parameters->width, MAX_TEXTURE_SIZE));
+        height = floorPowerOfTwo(std::min(parameters->height, MAX_TEXTURE_SIZE));
+        fps = outputFps;
+        frameCount = std::max(1, decoder.countPackets());
+        AVRational rate = stream->avg_frame_rate;
+        frameRate = frameCount > 1 && rate.num > 0 && rate.den > 0 ? (double)rate.num / rate.den : 0.0;
+        return true;
+    }
+
+    // The clip frame shown in an output frame; clips loop
+    int frameAt(int frameNum) const {
+        if (frameRate <= 0) return 0;
+        return (int)((int64_t)std::floor(frameNum * frameRate / fps + 1e-6) % frameCount);
+    }
+};
+
+// Decodes a screen clip forward into one texture as frames ask for it. One
+// per render thread and pass: the texture is rewritten by the next call, so
+// it must be drawn and flushed first. Going back, to loop or for an earlier
+// segment, restarts the decode from the top.
+class ScreenPlayer {
+private:
+    const ScreenClip* clip;
+    TextureDecoder decoder;
+    Texture texture;
+    int decoded;        // Clip frames the decoder has produced since it opened
+    int shown;          // Clip frame in the texture, -1 for none
+    bool failed;
+
+public:
+    explicit ScreenPlayer(const ScreenClip* clip) : clip(clip), decoded(0), shown(-1), failed(false) {
+        if (clip) texture.create(clip->width, clip->height);
+    }
+
+    // The screen texture for an output frame, or null for the flat screen:
+    // no clip, or it could not be decoded
+    const Texture* frame(int frameNum) {
+        if (!clip || failed) return nullptr;
+        int target = clip->frameAt(frameNum);
+        if (target == shown) return &texture;
+
+        StageTimer timer(STAGE_DECODE, frameNum);
+        if (decoded == 0 || target < decoded - 1) {
+            decoded = 0;
+            failed = !decoder.open(clip->path);
+        }
+        // A clip shorter than probed holds its last frame
+        while (!failed && decoded <= target && decoder.next()) decoded++;
+        if (!failed && decoded == 0) {
+            std::cerr << "No frames decoded from " << clip->path << std::endl;
+            failed = true;
+        }
+        if (failed) return nullptr;
+
+        // The phone's screen colour behind transparent parts
+        if (decoded - 1 != shown) {
+            if (!decoder.upload(texture, Color(26, 32, 44))) {
+                std::cerr << "Cannot scale " << clip->path << std::endl;
+                failed = true;
+                return nullptr;
+            }
+            shown = decoded - 1;
+        }
+        return &texture;
+    }
+};
+
+// ============================================================================
+// Animation
+// ============================================================================
+
+// Everything about a frame is a pure function of its number, which is what
+// lets segments of the timeline render independently
+struct FrameScene {
+    float t;
+    float xPos;
+    Mat4 modelMatrix;
+};
+
+// The phone's tumble at a given rotation angle, placed at (x, y, z)
+static Mat4 tumbleMatrix(float angle, float x, float y, float z) {
+    Mat4 rotationX = Mat4::rotationX(angle * 0.8f);   // Flip/tumble effect
+    Mat4 rotationY = Mat4::rotationY(angle * 1.2f);   // Spin around vertical axis
+    Mat4 rotationZ = Mat4::rotationZ(angle * 0.4f);   // Roll effect
+    Mat4 translation = Mat4::translation(x, y, z);
+    
+    // Combine transformations: Translate * RotateZ * RotateY * RotateX
+    // Order matters! We want to rotate first, then translate
+    return translation * rotationZ * rotationY * rotationX;
+}
+
+static FrameScene animateFrame(int frameNum, int totalFrames) {
+    FrameScene scene;
+    scene.t = (float)frameNum / (float)totalFrames;
+    
+    // Screen crossing movement (left to right)
+    float screen_width_world = 12.0f;  // World space width
+    scene.xPos = -screen_width_world/2 + scene.t * screen_width_world;  // Move left to right
+    
+    // 3D rotation for dynamic effect
+    float angle = scene.t * 2.0f * PI;
+    
+    // Position phone in 3D space, moving across screen, away from camera
+    scene.modelMatrix = tumbleMatrix(angle, scene.xPos, 0, -8.0f);
+    return scene;
+}
+
+// Centre a mesh on the origin and scale its longest side to the phone's height
+static Mat4 fitToPhone(const MeshView& mesh) {
+    Vec3 size = mesh.boundsMax - mesh.boundsMin;
+    float extent = std::max({size.x, size.y, size.z});
+    if (!(extent > 0)) return Mat4();
+    Vec3 centre = (mesh.boundsMin + mesh.boundsMax) * 0.5f;
+    float scale = 2.0f / extent;
+    return Mat4::scale(scale, scale, scale) * Mat4::translation(-centre.x, -centre.y, -centre.z);
+}
+
+// Instances of one mesh, each crossing the screen and tumbling like the
+// phone with its own lane, speed, phase and size. Parameters are parallel
+// arrays so a frame's matrices are composed in one pass.
+struct Scene {
+    MeshView mesh;
+    Mat4 fit;               // Applied to the mesh before each instance transform
+    Vec3 boundsCentre;      // Bounding sphere of the unfitted mesh
+    float boundsRadius;
+    int totalFrames;        // t runs from 0 to 1 over this many frames
+
+    std::vector<float> startX, travel, laneWidth;   // x = startX + t * travel, wrapped to the lane
+    std::vector<float> posY, posZ;
+    std::vector<float> phase, spin, scale;
+
+    // Submit nearest instances first so the hierarchical depth test rejects
+    // more of what is behind them. Off by default: instances at exactly equal
+    // depth then resolve in a different order.
+    bool frontToBack;
+
+    // Shown on the mesh's textured faces, null for their flat colour
+    std::shared_ptr<const ScreenClip> screen;
+
+    Scene(const MeshView& mesh, const Mat4& fit, int totalFrames)
+        : mesh(mesh), fit(fit), totalFrames(totalFrames), frontToBack(false) {
+        boundsCentre = (mesh.boundsMin + mesh.boundsMax) * 0.5f;
+        boundsRadius = (mesh.boundsMax - mesh.boundsMin).length() * 0.5f;
+    }
+
+    size_t instanceCount() const { return startX.size(); }
+
+    // A lane width of 0 never wraps
+    void addInstance(float x, float travelX, float lane, float y, float z, float phaseT, float spinRate, float size) {
+        startX.push_back(x);
+        travel.push_back(travelX);
+        laneWidth.push_back(lane);
+        posY.push_back(y);
+        posZ.push_back(z);
+        phase.push_back(phaseT);
+        spin.push_back(spinRate);
+        scale.push_back(size);
+    }
+
+    // The original phone: once across a 12 unit wide path, 8 units away
+    void addHero() { addInstance(-6.0f, 12.0f, 0, 0, -8.0f, 0, 1.0f, 1.0f); }
+};
+
+// Fill the view with a crowd of instances at random depths. Each lane is
+// the visible width at its depth plus a margin, so instances wrap around
+// off screen. Deterministic, so segments agree on the layout.
+static void addCrowd(Scene& scene, int count, const Mat4& projection) {
+    uint32_t state = 0x9E3779B9u;
+    auto random = [&state](float lo, float hi) {
+        state = state * 1664525u + 1013904223u;
+        return lo + (hi - lo) * (float)(state >> 8) / 16777216.0f;
+    };
+
+    for (int i = 0; i < count; i++) {
+        float z = random(-60.0f, -6.0f);
+        float halfHeight = -z / projection.m[1][1];
+        float halfWidth = -z / projection.m[0][0];
+        float lane = 2.0f * halfWidth + 4.0f;
+        scene.addInstance(random(-0.5f, 0.5f) * lane, lane * random(0.3f, 1.0f), lane,
+                          random(-0.9f, 0.9f) * halfHeight, z,
+                          random(0.0f, 1.0f), random(0.5f, 1.5f), random(0.6f, 1.2f));
+    }
+}
+
+// View-space frustum planes (a, b, c, d) with inward unit normals, taken
+// from the rows of a projection matrix
+struct Frustum {
+    float planes[6][4];
+
+    explicit Frustum(const Mat4& p) {
+        for (int i = 0; i < 3; i++) {
+            for (int side = 0; side < 2; side++) {
+                float* plane = planes[i * 2 + side];
+                float sign = side ? -1.0f : 1.0f;
+                for (int k = 0; k < 4; k++) plane[k] = p.m[3][k] + sign * p.m[i][k];
+                float length = std::sqrt(plane[0] * plane[0] + plane[1] * plane[1] + plane[2] * plane[2]);
+                for (int k = 0; k < 4; k++) plane[k] /= length;
+            }
+        }
+    }
+
+    bool intersectsSphere(const Vec3& centre, float radius) const {
+        for (const float* plane : planes) {
+            if (plane[0] * centre.x + plane[1] * centre.y + plane[2] * centre.z + plane[3] < -radius) return false;
+        }
+        return true;
+    }
+};
+
+// Reusable storage for composeScene(), owned by the caller so steady-state
+// frames do not allocate. Pool workers write into it for their chunks.
+struct SceneScratch {
+    std::vector<Mat4> mvps;
+    std::vector<uint8_t> visible;
+    std::vector<float> viewDepth;
+    std::vector<uint32_t> order;
+    std::vector<Mat4> draws;
+};
+
+// Compose every instance's MVP for the frame and cull it against the view
+// frustum by bounding sphere. Returns the MVPs of the survivors in
+// submission order, which with the scene decide every pixel of the frame.
+// The result lives in scratch and is valid until its next use.
+static const std::vector<Mat4>& composeScene(const Scene& scene, int frameNum, const Mat4& projection,
+                                             ThreadPool* pool, SceneScratch& scratch) {
+    static const int INSTANCE_CHUNK = 1024;
+
+    // Sized here, on the calling thread; chunks only write their own entries
+    size_t count = scene.instanceCount();
+    if (scratch.mvps.size() < count) {
+        scratch.mvps.resize(count);
+        scratch.visible.resize(count);
+        scratch.viewDepth.resize(count);
+        scratch.order.reserve(count);
+    }
+    Mat4* mvps = scratch.mvps.data();
+    uint8_t* visible = scratch.visible.data();
+    float* viewDepth = scratch.viewDepth.data();
+
+    Frustum frustum(projection);
+    float t = (float)frameNum / (float)scene.totalFrames;
+
+    auto composeChunk = [&](int chunk) {
+        size_t end = std::min(count, (size_t)(chunk + 1) * INSTANCE_CHUNK);
+        for (size_t i = (size_t)chunk * INSTANCE_CHUNK; i < end; i++) {
+            float x = scene.startX[i] + t * scene.travel[i];
+            float lane = scene.laneWidth[i];
+            if (lane > 0) x -= lane * std::floor(x / lane + 0.5f);
+
+            float angle = (t + scene.phase[i]) * 2.0f * PI;
+            angle *= scene.spin[i];
+            Mat4 model = tumbleMatrix(angle, x, scene.posY[i], scene.posZ[i]);
+            if (scene.scale[i] != 1.0f) model = model * Mat4::scale(scene.scale[i], scene.scale[i], scene.scale[i]);
+            model = model * scene.fit;
+
+            // The largest axis scale bounds how far the sphere's radius grows
+            float axisScale = 0;
+            for (int c = 0; c < 3; c++) {
+                Vec3 axis(model.m[0][c], model.m[1][c], model.m[2][c]);
+                axisScale = std::max(axisScale, axis.length());
+            }
+            Vec3 centre = (model * Vec4(scene.boundsCentre)).xyz();
+            viewDepth[i] = -centre.z;
+            visible[i] = frustum.intersectsSphere(centre, scene.boundsRadius * axisScale);
+            if (visible[i]) mvps[i] = projection * model;
+        }
+    };
+
+    int chunks = (int)((count + INSTANCE_CHUNK - 1) / INSTANCE_CHUNK);
+    if (pool && chunks > 1) {
+        pool->parallelFor(chunks, composeChunk);
+    } else {
+        for (int chunk = 0; chunk < chunks; chunk++) composeChunk(chunk);
+    }
+
+    std::vector<uint32_t>& order = scratch.order;
+    order.clear();
+    for (size_t i = 0; i < count; i++) {
+        if (visible[i]) order.push_back((uint32_t)i);
+    }
+    // Sort keys are the depths the chunks just wrote. Ties keep instance
+    // order, so the draws, and the frame keys hashed from them, do not
+    // depend on the sort's handling of equal elements.
+    if (scene.frontToBack) {
+        std::sort(order.begin(), order.end(), [viewDepth](uint32_t a, uint32_t b) {
+            return viewDepth[a] < viewDepth[b] || (viewDepth[a] == viewDepth[b] && a < b);
+        });
+    }
+
+    std::vector<Mat4>& draws = scratch.draws;
+    draws.clear();
+    for (uint32_t i : order) draws.push_back(mvps[i]);
+    return draws;
+}
+
+// White, like the original
+static const Color BACKGROUND_COLOR(255, 255, 255);
+
+// screen is the frame's screen texture, see ScreenPlayer, or null
+static void drawFrame(const std::vector<Mat4>& draws, const Scene& scene, Framebuffer& framebuffer, Renderer& renderer,
+                      int frameNum, const Texture* screen = nullptr) {
+    {
+        StageTimer timer(STAGE_CLEAR, frameNum);
+        framebuffer.clear(BACKGROUND_COLOR);
+    }
     
+    // Render the scene
+    StageTimer timer(STAGE_RASTER, frameNum);
+    RasterState state;
+    state.texture = screen;
+    for (const Mat4& mvp : draws) renderer.drawMesh(scene.mesh, mvp, state);
+    renderer.flush();
+}
+
+// ============================================================================
+// Frame Cache
+// ============================================================================
+
+// Where a frame's pixels come from. Repeats and cached frames skip both
+// rasterization and colour conversion.
+enum FrameOrigin {
+    FRAME_RENDERED,
+    FRAME_REPEAT,       // Same draws as the frame before it in the stream
+    FRAME_CACHED        // Read back from the frame cache
+};
+
+struct FrameStats {
+    std::atomic<uint64_t> rendered, repeated, cached;
+};
+
+static FrameStats frameStats;
+
+static void printFrameStats() {
+    if (frameStats.repeated == 0 && frameStats.cached == 0) return;
+    std::cout << "Frames: " << frameStats.rendered << " rendered, " << frameStats.repeated << " repeated, "
+              << frameStats.cached << " from cache" << std::endl;
+}
+
+// 64-bit hash of a byte range, eight bytes at a time, chained through seed
+static uint64_t hashBytes(const void* data, size_t size, uint64_t seed) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    uint64_t h = seed ^ (size * 0x9E3779B97F4A7C15ull);
+    auto mix = [&h](uint64_t word) {
+        h ^= word * 0xBF58476D1CE4E5B9ull;
+        h = ((h << 31) | (h >> 33)) * 0x94D049BB133111EBull;
+    };
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, bytes + i, 8);
+        mix(word);
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, bytes + i, size - i);
+    mix(tail);
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ull;
+    return h ^ (h >> 32);
+}
+
+// Identifies what the scene's screen shows in a frame: the clip and the
+// frame of it. 0 without a screen.
+static uint64_t screenKey(const Scene& scene, int frameNum) {
+    const ScreenClip* clip = scene.screen.get();
+    if (!clip) return 0;
+    int64_t identity[] = {clip->fileSize, clip->fileMtime, clip->width, clip->height, clip->frameAt(frameNum)};
+    return hashBytes(identity, sizeof(identity), hashBytes(clip->path.data(), clip->path.size(), 0)) | 1;
+}
+
+// PackBits, one row at a time: a control byte n < 128 is followed by n + 1
+// literal bytes, n > 128 repeats the next byte 257 - n times
+static void packBitsRow(const uint8_t* row, int width, std::string& out) {
+    int x = 0;
+    while (x < width) {
+        // Flat rows are the common case, so runs are matched eight bytes at a time first
+        uint64_t pattern = row[x] * 0x0101010101010101ull;
+        int run = 1;
+        while (run <= 120 && x + run + 8 <= width) {
+            uint64_t word;
+            std::memcpy(&word, row + x + run, 8);
+            if (word != pattern) break;
+            run += 8;
+        }
+        while (x + run < width && run < 128 && row[x + run] == row[x]) run++;
+        if (run > 1) {
+            out.push_back((char)(257 - run));
+            out.push_back((char)row[x]);
+            x += run;
+            continue;
+        }
+
+        // Literals up to where a run of three starts
+        int start = x;
+        while (x < width && x - start < 128) {
+            if (x + 2 < width && row[x] == row[x + 1] && row[x] == row[x + 2]) break;
+            x++;
+        }
+        out.push_back((char)(x - start - 1));
+        out.append(reinterpret_cast<const char*>(row + start), x - start);
+    }
+}
+
+static bool unpackBitsRow(const uint8_t*& in, const uint8_t* end, uint8_t* row, int width) {
+    int x = 0;
+    while (x < width) {
+        if (in >= end) return false;
+        int n = *in++;
+        if (n < 128) {
+            int count = n + 1;
+            if (count > width - x || end - in < count) return false;
+            std::memcpy(row + x, in, count);
+            in += count;
+            x += count;
+        } else if (n > 128) {
+            int count = 257 - n;
+            if (count > width - x || in >= end) return false;
+            std::memset(row + x, *in++, count);
+            x += count;
+        }
+    }
+    return true;
+}
+
+// Copy src into dst, only the row pairs where either may differ from the background
+static void copyFrame(const AVFrame* src, const Rect& srcDrawn, AVFrame* dst, Rect& dstDrawn) {
+    Rect changed = srcDrawn.united(dstDrawn);
+    dstDrawn = srcDrawn;
+    if (changed.empty()) return;
+
+    int y0 = changed.y0 & ~1, y1 = std::min(src->height, (changed.y1 + 1) & ~1);
+    for (int plane = 0; plane < 3; plane++) {
+        int shift = plane ? 1 : 0;
+        int width = (src->width + shift) >> shift;
+        for (int y = y0 >> shift; y < (y1 + shift) >> shift; y++) {
+            std::memcpy(dst->data[plane] + (size_t)y * dst->linesize[plane],
+                        src->data[plane] + (size_t)y * src->linesize[plane], width);
+        }
+    }
+}
+
+static const char FRAME_FILE_MAGIC[8] = {'V', 'R', 'F', 'R', 'A', 'M', 'E', '\n'};
+static const uint32_t FRAME_FILE_VERSION = 1;
+
+// Bump whenever rendering or conversion changes what a frame looks like,
+// so older cached frames stop matching
+static const uint64_t FRAME_CACHE_EPOCH = 2;
+
+struct FrameFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t width, height;
+    int32_t drawn[4];           // Where the planes may differ from the background, see Framebuffer::getDrawn
+    uint32_t reserved;
+    uint64_t key;
+    uint64_t payloadSize;       // PackBits rows of Y, then U, then V
+    uint64_t payloadHash;
+};
+
+// Converted YUV420 frames on disk, one PackBits-compressed file per frame
+// named after its key. The key hashes everything that decides the pixels:
+// output format, background, mesh, each draw's MVP and the screen content, so a re-render after
+// an edit only renders the frames whose draws changed. Encoded segments are
+// kept too, as whole closed GOPs are the only unit that can skip the
+// encoder. Files are written via a temporary and renamed, so concurrent
+// runs can share a directory.
+class FrameCache {
+private:
+    std::string directory;
+    VideoFormat format;
+    uint64_t streamHash;    // Shared by every frame of the stream
+
+    std::string cachePath(uint64_t key, const char* extension) const {
+        char name[48];
+        std::snprintf(name, sizeof(name), "%016llx%s", (unsigned long long)key, extension);
+        return directory + "/" + name;
+    }
+
+    static bool writeFile(const std::string& path, const std::string& contents) {
+        static std::atomic<int> serial(0);
+        std::string tempPath = path + ".tmp" + std::to_string(getpid()) + "." + std::to_string(serial++);
+        FILE* file = std::fopen(tempPath.c_str(), "wb");
+        if (!file) return false;
+        bool ok = std::fwrite(contents.data(), 1, contents.size(), file) == contents.size();
+        if (std::fclose(file) != 0) ok = false;
+        if (ok) ok = std::rename(tempPath.c_str(), path.c_str()) == 0;
+        if (!ok) std::remove(tempPath.c_str());
+        return ok;
+    }
+
+public:
+    FrameCache(const std::string& directory, const Scene& scene, RenderTarget target, const EncoderSettings& settings)
+        : directory(directory), format(settings.format) {
+        int32_t output[] = {format.width, format.height, format.fps, (int32_t)target, (int32_t)settings.converter,
+                            (int32_t)settings.matrix};
+        uint64_t h = hashBytes(&FRAME_CACHE_EPOCH, sizeof(FRAME_CACHE_EPOCH), 0);
+        h = hashBytes(output, sizeof(output), h);
+        h = hashBytes(&BACKGROUND_COLOR, sizeof(Color), h);
+        h = hashBytes(scene.mesh.px, scene.mesh.vertexCount * sizeof(float), h);
+        h = hashBytes(scene.mesh.py, scene.mesh.vertexCount * sizeof(float), h);
+        h = hashBytes(scene.mesh.pz, scene.mesh.vertexCount * sizeof(float), h);
+        h = hashBytes(scene.mesh.indices, scene.mesh.triangleCount * 3 * sizeof(uint32_t), h);
+        h = hashBytes(scene.mesh.faceColors, scene.mesh.triangleCount * sizeof(Color), h);
+        if (scene.screen && scene.mesh.texturedFaces && scene.mesh.texU) {
+            h = hashBytes(scene.mesh.texU, scene.mesh.vertexCount * sizeof(float), h);
+            h = hashBytes(scene.mesh.texV, scene.mesh.vertexCount * sizeof(float), h);
+            h = hashBytes(scene.mesh.texturedFaces, scene.mesh.triangleCount, h);
+        }
+        streamHash = h;
+    }
+
+    // Create the directory if needed
+    bool open() const {
+        if (mkdir(directory.c_str(), 0755) == 0 || errno == EEXIST) return true;
+        std::cerr << "Cannot create frame cache " << directory << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    // screen is the frame's screenKey(); frames without a screen keep their old keys
+    uint64_t frameKey(const std::vector<Mat4>& draws, uint64_t screen) const {
+        uint64_t h = hashBytes(draws.data(), draws.size() * sizeof(Mat4), streamHash);
+        return screen ? hashBytes(&screen, sizeof(screen), h) : h;
+    }
+
+    // Read and verify a cached frame, for decode() later
+    bool load(uint64_t key, std::string& contents) const {
+        if (!readFile(cachePath(key, ".vrframe"), contents) || contents.size() < sizeof(FrameFileHeader)) return false;
+        FrameFileHeader header;
+        std::memcpy(&header, contents.data(), sizeof(header));
+        return std::memcmp(header.magic, FRAME_FILE_MAGIC, sizeof(header.magic)) == 0 &&
+               header.version == FRAME_FILE_VERSION && (int)header.width == format.width && (int)header.height == format.height &&
+               header.key == key && header.payloadSize == contents.size() - sizeof(header) &&
+               header.payloadHash == hashBytes(contents.data() + sizeof(header), header.payloadSize, 0);
+    }
+
+    void decode(const std::string& contents, AVFrame* dst, Rect& dstDrawn) const {
+        FrameFileHeader header;
+        std::memcpy(&header, contents.data(), sizeof(header));
+        dstDrawn = Rect(header.drawn[0], header.drawn[1], header.drawn[2], header.drawn[3]);
+
+        const uint8_t* in = reinterpret_cast<const uint8_t*>(contents.data()) + sizeof(header);
+        const uint8_t* end = reinterpret_cast<const uint8_t*>(contents.data()) + contents.size();
+        for (int plane = 0; plane < 3; plane++) {
+            int shift = plane ? 1 : 0;
+            for (int y = 0; y < (format.height + shift) >> shift; y++) {
+                unpackBitsRow(in, end, dst->data[plane] + (size_t)y * dst->linesize[plane], (format.width + shift) >> shift);
+            }
+        }
+    }
+
+    bool store(uint64_t key, const AVFrame* src, const Rect& drawn) const {
+        thread_local std::string contents;
+        contents.assign(sizeof(FrameFileHeader), '\0');
+        for (int plane = 0; plane < 3; plane++) {
+            int shift = plane ? 1 : 0;
+            for (int y = 0; y < (format.height + shift) >> shift; y++) {
+                packBitsRow(src->data[plane] + (size_t)y * src->linesize[plane], (format.width + shift) >> shift, contents);
+            }
+        }
+
+        FrameFileHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, FRAME_FILE_MAGIC, sizeof(header.magic));
+        header.version = FRAME_FILE_VERSION;
+        header.width = format.width;
+        header.height = format.height;
+        header.drawn[0] = drawn.x0; header.drawn[1] = drawn.y0; header.drawn[2] = drawn.x1; header.drawn[3] = drawn.y1;
+        header.key = key;
+        header.payloadSize = contents.size() - sizeof(header);
+        header.payloadHash = hashBytes(contents.data() + sizeof(header), header.payloadSize, 0);
+        contents.replace(0, sizeof(header), reinterpret_cast<const char*>(&header), sizeof(header));
+        return writeFile(cachePath(key, ".vrframe"), contents);
+    }
+
+    // A segment's frame keys in order, plus the GOP size and profile; the
+    // rest of the encoder setup is fixed or already in the stream hash
+    uint64_t segmentKey(const Scene& scene, int startFrame, int endFrame, const EncoderSettings& settings,
+                        ThreadPool* pool) const {
+        int32_t encoding[] = {settings.gop(), (int32_t)settings.profile};
+        Mat4 projection = Renderer::defaultProjection(format.aspect());
+        uint64_t h = hashBytes(encoding, sizeof(encoding), streamHash);
+        SceneScratch scratch;
+        for (int frameNum = startFrame; frameNum < endFrame; frameNum++) {
+            uint64_t key = frameKey(composeScene(scene, frameNum, projection, pool, scratch), screenKey(scene, frameNum));
+            h = hashBytes(&key, sizeof(key), h);
+        }
+        return h;
+    }
+
+    // Copy a segment encoded by an earlier run to path
+    bool loadSegment(uint64_t key, const std::string& path) const {
+        std::string contents;
+        return readFile(cachePath(key, ".vrsegment"), contents) && writeFile(path, contents);
+    }
+
+    bool storeSegment(uint64_t key, const std::string& path) const {
+        std::string contents;
+        return readFile(path, contents) && writeFile(cachePath(key, ".vrsegment"), contents);
+    }
+};
+
+// Decides, before anything is rasterized, where each frame of a stream
+// comes from. Repeats compare the draws exactly, and the screen frame by
+// key; only the cache relies on the hash of the draws.
+class FrameSource {
+private:
+    const FrameCache* cache;
+    std::vector<Mat4> previous;
+    uint64_t previousScreen;
+    bool hasPrevious;
+
+public:
+    explicit FrameSource(const FrameCache* cache) : cache(cache), previousScreen(0), hasPrevious(false) {}
+
+    // screen is the frame's screenKey(). The key is only set with a cache;
+    // contents receive a cached frame.
+    FrameOrigin classify(const std::vector<Mat4>& draws, uint64_t screen, uint64_t& key, std::string& contents) {
+        if (hasPrevious && screen == previousScreen && draws.size() == previous.size() &&
+            std::memcmp(draws.data(), previous.data(), draws.size() * sizeof(Mat4)) == 0) {
+            frameStats.repeated++;
+            return FRAME_REPEAT;
+        }
+        previous = draws;
+        previousScreen = screen;
+        hasPrevious = true;
+
+        key = cache ? cache->frameKey(draws, screen) : 0;
+        if (cache && cache->load(key, contents)) {
+            frameStats.cached++;
+            return FRAME_CACHED;
+        }
+        frameStats.rendered++;
+        return FRAME_RENDERED;
+    }
+};
+
+// ============================================================================
+// Frame Pipeline
+// ============================================================================
+
+// Framebuffers with their renderers, encoder frames and swscale contexts,
+// kept warm between the jobs that run one after another on a worker, so
+// back-to-back clips of one format allocate nothing. Not thread-safe: one
+// pool per worker.
+class RenderPool {
+public:
+    struct Target {
+        std::unique_ptr<Framebuffer> framebuffer;
+        std::unique_ptr<Renderer> renderer;
+    };
+
+private:
+    std::vector<Target> targets;
+    std::vector<AVFrame*> frames;
+    SwsContext* scaler;
+
+public:
+    RenderPool() : scaler(nullptr) {}
+
+    ~RenderPool() {
+        for (AVFrame*& frame : frames) av_frame_free(&frame);
+        if (scaler) sws_freeContext(scaler);
+    }
+
+    RenderPool(const RenderPool&) = delete;
+    RenderPool& operator=(const RenderPool&) = delete;
+
+    Target acquireTarget(const VideoFormat& format, RenderTarget target, ColorMatrix matrix, ThreadPool* pool) {
+        for (size_t i = 0; i < targets.size(); i++) {
+            const Framebuffer& fb = *targets[i].framebuffer;
+            if (fb.getWidth() == format.width && fb.getHeight() == format.height && fb.getTarget() == target &&
+                fb.getMatrix() == matrix && targets[i].renderer->getPool() == pool) {
+                Target found = std::move(targets[i]);
+                targets.erase(targets.begin() + i);
+                return found;
+            }
+        }
+        Target created;
+        created.framebuffer = std::make_unique<Framebuffer>(format.width, format.height, target, matrix);
+        created.renderer = std::make_unique<Renderer>(*created.framebuffer, pool);
+        return created;
+    }
+
+    void releaseTarget(Target&& target) { targets.push_back(std::move(target)); }
+
+    // A frame in the encoder's format. Its contents are whatever the last
+    // job left, so callers treat all of it as drawn.
+    AVFrame* acquireFrame(const VideoEncoder& encoder) {
+        const VideoFormat& format = encoder.getFormat();
+        for (size_t i = 0; i < frames.size(); i++) {
+            if (frames[i]->width == format.width && frames[i]->height == format.height) {
+                AVFrame* found = frames[i];
+                frames.erase(frames.begin() + i);
+                return found;
+            }
+        }
+        return encoder.allocFrame();
+    }
+
+    void releaseFrame(AVFrame* frame) {
+        if (frame) frames.push_back(frame);
+    }
+
+    // The swscale context for VideoEncoder::init, or null with the builtin
+    // converter. Reused while the size stays the same; owned by the pool.
+    SwsContext* acquireScaler(const EncoderSettings& settings) {
+        if (settings.converter != CONVERTER_SWSCALE) return nullptr;
+        const VideoFormat& format = settings.format;
+        scaler = sws_getCachedContext(scaler, format.width, format.height, AV_PIX_FMT_RGBA,
+                                      format.width, format.height, AV_PIX_FMT_YUV420P,
+                                      SWS_BILINEAR, nullptr, nullptr, nullptr);
+        if (!scaler) return nullptr;
+        const int* coefficients = sws_getCoefficients(settings.matrix == COLOR_MATRIX_BT709 ? SWS_CS_ITU709 : SWS_CS_ITU601);
+        sws_setColorspaceDetails(scaler, coefficients, 1, coefficients, 0, 0, 1 << 16, 1 << 16);
+        return scaler;
+    }
+};
+
+// Render, colour conversion and encoding each run on their own thread, so
+// frame N+2 renders while N+1 converts and N encodes. A fixed ring of
+// framebuffers and AVFrames circulates through SPSC queues; a stage waits
+// when the next one falls behind, so memory stays fixed however long the
+// video is. Each queue is FIFO with one thread per stage, so frames reach
+// the encoder in order. Frames that are not rendered still pass through
+// every stage, and are filled by whichever stage fills rendered ones.
+class FramePipeline {
+private:
+    struct Ticket {
+        int frameNum;   // -1 marks the end of the stream
+        int slot;
+        FrameOrigin origin;
+        uint64_t key;   // Frame cache key, when there is a cache
+    };
+
+    VideoEncoder& encoder;
+    RenderTarget target;
+    const FrameCache* cache;
+    RenderPool& resources;
+    std::vector<RenderPool::Target> targets;
+    std::vector<std::string> cachedFrames;  // Per framebuffer, the cached frame its ticket carries
+    std::vector<AVFrame*> frames;
+    std::vector<Rect> frameDrawn;   // Drawn bounds of what each frame last received, see convertFrame
+    int lastFilled;                 // Frame holding the previous frame of the stream
+
+    SpscQueue<int> freeFramebuffers;
+    SpscQueue<int> freeFrames;
+    SpscQueue<Ticket> rendered;
+    SpscQueue<Ticket> converted;
+
+    // Fill a frame that was not rendered. Only one stage fills frames, so
+    // the one holding the previous frame is intact and may even be slot.
+    void fillFrame(const Ticket& ticket, int slot, const std::string& cached) {
+        av_frame_make_writable(frames[slot]);
+        if (ticket.origin == FRAME_CACHED) {
+            StageTimer timer(STAGE_CACHE, ticket.frameNum);
+            cache->decode(cached, frames[slot], frameDrawn[slot]);
+        } else if (slot != lastFilled) {
+            StageTimer timer(STAGE_COPY, ticket.frameNum);
+            copyFrame(frames[lastFilled], frameDrawn[lastFilled], frames[slot], frameDrawn[slot]);
+        }
+        lastFilled = slot;
+    }
+
+    void storeFrame(const Ticket& ticket, int slot) {
+        lastFilled = slot;
+        if (!cache) return;
+        StageTimer timer(STAGE_CACHE, ticket.frameNum);
+        cache->store(ticket.key, frames[slot], frameDrawn[slot]);
+    }
+
+    // YUV420 framebuffers render straight into a pooled frame and skip the
+    // conversion stage entirely
+    void renderStage(int startFrame, int endFrame, const Scene& scene) {
+        telemetry.nameThread("render");
+        FrameSource source(cache);
+        ScreenPlayer screen(scene.screen.get());
+        SceneScratch scratch;
+        for (int frameNum = startFrame; frameNum < endFrame; frameNum++) {
+            int fb = freeFramebuffers.pop();
+            Renderer& renderer = *targets[fb].renderer;
+            StageTimer composeTimer(STAGE_COMPOSE, frameNum);
+            const std::vector<Mat4>& draws =
+                composeScene(scene, frameNum, renderer.getProjectionMatrix(), renderer.getPool(), scratch);
+            Ticket ticket = {frameNum, fb, FRAME_RENDERED, 0};
+            ticket.origin = source.classify(draws, screenKey(scene, frameNum), ticket.key, cachedFrames[fb]);
+            composeTimer.stop();
+
+            if (target == RENDER_TARGET_YUV420) {
+                int slot = freeFrames.pop();
+                if (ticket.origin == FRAME_RENDERED) {
+                    av_frame_make_writable(frames[slot]);
+                    targets[fb].framebuffer->bindYuvTarget(frames[slot]->data, frames[slot]->linesize, frameDrawn[slot]);
+                    drawFrame(draws, scene, *targets[fb].framebuffer, renderer, frameNum, screen.frame(frameNum));
+                    frameDrawn[slot] = targets[fb].framebuffer->getDrawn();
+                    storeFrame(ticket, slot);
+                } else {
+                    fillFrame(ticket, slot, cachedFrames[fb]);
+                }
+                freeFramebuffers.push(fb);
+                ticket.slot = slot;
+                converted.push(ticket);
+            } else {
+                if (ticket.origin == FRAME_RENDERED) {
+                    drawFrame(draws, scene, *targets[fb].framebuffer, renderer, frameNum, screen.frame(frameNum));
+                }
+                rendered.push(ticket);
+            }
+        }
+        (target == RENDER_TARGET_YUV420 ? converted : rendered).push(Ticket{-1, -1, FRAME_RENDERED, 0});
+    }
+
+    void convertStage() {
+        telemetry.nameThread("convert");
+        while (true) {
+            Ticket ticket = rendered.pop();
+            if (ticket.frameNum < 0) break;
+
+            int slot = freeFrames.pop();
+            if (ticket.origin == FRAME_RENDERED) {
+                {
+                    StageTimer timer(STAGE_CONVERT, ticket.frameNum);
+                    encoder.convertFrame(*targets[ticket.slot].framebuffer, frames[slot], frameDrawn[slot]);
+                }
+                storeFrame(ticket, slot);
+            } else {
+                fillFrame(ticket, slot, cachedFrames[ticket.slot]);
+            }
+            freeFramebuffers.push(ticket.slot);
+            ticket.slot = slot;
+            converted.push(ticket);
+        }
+        converted.push(Ticket{-1, -1, FRAME_RENDERED, 0});
+    }
+
+public:
+    FramePipeline(VideoEncoder& encoder, int depth, RenderTarget target, ColorMatrix matrix, ThreadPool* pool,
+                  const FrameCache* cache, RenderPool& resources)
+        : encoder(encoder), target(target), cache(cache), resources(resources), lastFilled(0),
+          freeFramebuffers(depth), freeFrames(depth), rendered(depth), converted(depth) {
+        // Only the render stage touches a YUV420 framebuffer, so one is enough
+        const VideoFormat& format = encoder.getFormat();
+        int framebufferCount = (target == RENDER_TARGET_YUV420) ? 1 : depth;
+        for (int i = 0; i < framebufferCount; i++) {
+            targets.push_back(resources.acquireTarget(format, target, matrix, pool));
+            cachedFrames.emplace_back();
+            freeFramebuffers.push(i);
+        }
+        for (int i = 0; i < depth; i++) {
+            frames.push_back(resources.acquireFrame(encoder));
+            frameDrawn.push_back(Rect(0, 0, format.width, format.height));
+            freeFrames.push(i);
+        }
+    }
+
+    ~FramePipeline() {
+        for (RenderPool::Target& t : targets) resources.releaseTarget(std::move(t));
+        for (AVFrame* frame : frames) resources.releaseFrame(frame);
+    }
+
+    bool isValid() const {
+        for (AVFrame* frame : frames) {
+            if (!frame) return false;
+        }
+        return true;
+    }
+
+    // Encode [startFrame, endFrame) on the calling thread while the other
+    // stages run behind it. onEncoded is called after each frame is sent.
+    void run(int startFrame, int endFrame, const Scene& scene, const std::function<void(int)>& onEncoded) {
+        std::thread renderThread(&FramePipeline::renderStage, this, startFrame, endFrame, std::cref(scene));
+        std::thread convertThread;
+        if (target == RENDER_TARGET_RGBA) convertThread = std::thread(&FramePipeline::convertStage, this);
+        telemetry.nameThread("encode");
+
+        while (true) {
+            Ticket ticket = converted.pop();
+            if (ticket.frameNum < 0) break;
+
+            {
+                StageTimer timer(STAGE_ENCODE, ticket.frameNum);
+                encoder.encodeFrame(frames[ticket.slot]);
+            }
+            freeFrames.push(ticket.slot);
+            if (onEncoded) onEncoded(ticket.frameNum);
+        }
+
+        renderThread.join();
+        if (convertThread.joinable()) convertThread.join();
+    }
+};
+
+// Encode a range of frames, pipelined when depth > 0 and serially otherwise.
+// cache may be null.
+static bool encodeFrames(int startFrame, int endFrame, const Scene& scene, VideoEncoder& encoder,
+                         RenderTarget target, ColorMatrix matrix, int pipelineDepth, ThreadPool* pool,
+                         const FrameCache* cache, RenderPool& resources, const std::function<void(int)>& onEncoded) {
+    if (pipelineDepth > 0) {
+        FramePipeline pipeline(encoder, pipelineDepth, target, matrix, pool, cache, resources);
+        if (!pipeline.isValid()) return false;
+        pipeline.run(startFrame, endFrame, scene, onEncoded);
+        return true;
+    }
+
+    const VideoFormat& format = encoder.getFormat();
+    RenderPool::Target renderTarget = resources.acquireTarget(format, target, matrix, pool);
+    Framebuffer& framebuffer = *renderTarget.framebuffer;
+    Renderer& renderer = *renderTarget.renderer;
+    AVFrame* frame = resources.acquireFrame(encoder);
+    if (!frame) {
+        resources.releaseTarget(std::move(renderTarget));
+        return false;
+    }
+
+    Rect frameDrawn(0, 0, format.width, format.height);
+    FrameSource source(cache);
+    ScreenPlayer screen(scene.screen.get());
+    std::string cached;
+    SceneScratch scratch;
+    telemetry.nameThread("serial");
+    for (int frameNum = startFrame; frameNum < endFrame; frameNum++) {
+        StageTimer composeTimer(STAGE_COMPOSE, frameNum);
+        const std::vector<Mat4>& draws = composeScene(scene, frameNum, renderer.getProjectionMatrix(), pool, scratch);
+        uint64_t key = 0;
+        FrameOrigin origin = source.classify(draws, screenKey(scene, frameNum), key, cached);
+        composeTimer.stop();
+
+        // A repeat sends the frame as it is
+        av_frame_make_writable(frame);
+        if (origin == FRAME_CACHED) {
+            StageTimer timer(STAGE_CACHE, frameNum);
+            cache->decode(cached, frame, frameDrawn);
+        } else if (origin == FRAME_RENDERED) {
+            if (target == RENDER_TARGET_YUV420) framebuffer.bindYuvTarget(frame->data, frame->linesize, frameDrawn);
+            drawFrame(draws, scene, framebuffer, renderer, frameNum, screen.frame(frameNum));
+            if (target == RENDER_TARGET_RGBA) {
+                StageTimer timer(STAGE_CONVERT, frameNum);
+                encoder.convertFrame(framebuffer, frame, frameDrawn);
+            } else {
+                frameDrawn = framebuffer.getDrawn();
+            }
+            if (cache) {
+                StageTimer timer(STAGE_CACHE, frameNum);
+                cache->store(key, frame, frameDrawn);
+            }
+        }
+
+        {
+            StageTimer timer(STAGE_ENCODE, frameNum);
+            encoder.encodeFrame(frame);
+        }
+        if (onEncoded) onEncoded(frameNum);
+    }
+    resources.releaseFrame(frame);
+    resources.releaseTarget(std::move(renderTarget));
+    return true;
+}
+
+// ============================================================================
+// Segmented Encoding
+// ============================================================================
+
+// A run of frames encoded on its own into a closed-GOP part file. Parts are
+// joined afterwards by copying packets, so they can come from other machines.
+struct Segment {
+    int index;
+    int startFrame;
+    int endFrame;
+    std::string path;
+};
+
+static std::string segmentPath(const std::string& output, int index) {
+    char suffix[32];
+    std::snprintf(suffix, sizeof(suffix), ".part%03d", index);
+    size_t dot = output.find_last_of('.');
+    if (dot == std::string::npos) return output + suffix;
+    return output.substr(0, dot) + suffix + output.substr(dot);
+}
+
+// Split the timeline into at most `count` segments whose lengths are whole
+// GOPs, so the joined stream keeps the keyframe cadence of a single encode
+static std::vector<Segment> planSegments(int count, int gopSize, int totalFrames, const std::string& output) {
+    int gops = (totalFrames + gopSize - 1) / gopSize;
+    int gopsPerSegment = std::max(1, (gops + count - 1) / count);
+    int length = gopsPerSegment * gopSize;
+
+    std::vector<Segment> segments;
+    for (int start = 0; start < totalFrames; start += length) {
+        int index = (int)segments.size();
+        segments.push_back({index, start, std::min(totalFrames, start + length), segmentPath(output, index)});
+    }
+    return segments;
+}
+
+// A segment whose frames all match one encoded by an earlier run is copied
+// from the cache instead
+static bool encodeSegment(const Segment& segment, const Scene& scene, RenderTarget target,
+                          const EncoderSettings& settings, int pipelineDepth, ThreadPool* pool,
+                          const FrameCache* cache, RenderPool& resources) {
+    uint64_t key = 0;
+    if (cache) {
+        key = cache->segmentKey(scene, segment.startFrame, segment.endFrame, settings, pool);
+        if (cache->loadSegment(key, segment.path)) {
+            frameStats.cached += segment.endFrame - segment.startFrame;
+            return true;
+        }
+    }
+
+    VideoEncoder encoder;
+
+    EncoderSettings segmentSettings = settings;
+    segmentSettings.closedGop = true;
+    if (!encoder.init(segment.path.c_str(), segmentSettings, pool, resources.acquireScaler(settings))) return false;
+
+    bool ok = encodeFrames(segment.startFrame, segment.endFrame, scene, encoder, target, settings.matrix,
+                           pipelineDepth, pool, cache, resources, nullptr);
+    encoder.finish();
+    if (ok && cache) cache->storeSegment(key, segment.path);
+    return ok;
+}
+
+// Render and encode segments concurrently, each worker with its own
+// framebuffers, renderers and encoder, kept from one segment to the next.
+// Rasterization and colour conversion still share the pool.
+static bool encodeSegments(const std::vector<Segment>& segments, int workers, const Scene& scene,
+                           RenderTarget target, const EncoderSettings& settings, int pipelineDepth,
+                           ThreadPool* pool, const FrameCache* cache) {
+    std::atomic<int> next(0);
+    std::atomic<bool> ok(true);
+    std::mutex printMutex;
+
+    auto worker = [&]() {
+        RenderPool resources;
+        int i;
+        while ((i = next.fetch_add(1)) < (int)segments.size()) {
+            const Segment& segment = segments[i];
+            bool encoded = encodeSegment(segment, scene, target, settings, pipelineDepth, pool, cache, resources);
+            if (!encoded) ok = false;
+
+            std::lock_guard<std::mutex> lock(printMutex);
+            std::cout << (encoded ? "Encoded " : "Failed to encode ") << segment.path << " (frames "
+                      << segment.startFrame << "-" << segment.endFrame - 1 << ")" << std::endl;
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < std::min(workers, (int)segments.size()); i++) threads.emplace_back(worker);
+    for (auto& thread : threads) thread.join();
+    return ok;
+}
+
+// Stream-copy the parts into one file, shifting each part's timestamps by
+// its start frame. No re-encoding happens here.
+static bool concatSegments(const std::vector<Segment>& segments, int fps, const char* filename) {
+    AVFormatContext* outCtx = nullptr;
+    avformat_alloc_output_context2(&outCtx, nullptr, nullptr, filename);
+    if (!outCtx) return false;
+
+    AVStream* outStream = nullptr;
+    AVPacket* pkt = av_packet_alloc();
+    bool ok = true;
+
+    for (const Segment& segment : segments) {
+        AVFormatContext* inCtx = nullptr;
+        if (avformat_open_input(&inCtx, segment.path.c_str(), nullptr, nullptr) < 0) {
+            std::cerr << "Cannot open segment " << segment.path << std::endl;
+            ok = false;
+            break;
+        }
+
+        int streamIndex = -1;
+        if (avformat_find_stream_info(inCtx, nullptr) >= 0) {
+            streamIndex = av_find_best_stream(inCtx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+        }
+        if (streamIndex < 0) {
+            std::cerr << "No video stream in " << segment.path << std::endl;
+            avformat_close_input(&inCtx);
+            ok = false;
+            break;
+        }
+        AVStream* inStream = inCtx->streams[streamIndex];
+
+        // The first part defines the output stream; the rest share its parameters
+        if (!outStream) {
+            outStream = avformat_new_stream(outCtx, nullptr);
+            if (!outStream || avcodec_parameters_copy(outStream->codecpar, inStream->codecpar) < 0) ok = false;
+            if (ok) {
+                outStream->codecpar->codec_tag = 0;
+                outStream->time_base = inStream->time_base;
+                if (!(outCtx->oformat->flags & AVFMT_NOFILE) && avio_open(&outCtx->pb, filename, AVIO_FLAG_WRITE) < 0) ok = false;
+            }
+            if (ok && avformat_write_header(outCtx, nullptr) < 0) ok = false;
+            if (!ok) {
+                avformat_close_input(&inCtx);
+                break;
+            }
+        }
+
+        int64_t offset = av_rescale_q(segment.startFrame, AVRational{1, fps}, outStream->time_base);
+        while (av_read_frame(inCtx, pkt) >= 0) {
+            if (pkt->stream_index == streamIndex) {
+                av_packet_rescale_ts(pkt, inStream->time_base, outStream->time_base);
+                if (pkt->pts != AV_NOPTS_VALUE) pkt->pts += offset;
+                if (pkt->dts != AV_NOPTS_VALUE) pkt->dts += offset;
+                pkt->stream_index = outStream->index;
+                av_interleaved_write_frame(outCtx, pkt);
+            }
+            av_packet_unref(pkt);
+        }
+        avformat_close_input(&inCtx);
+    }
+
+    if (outStream && ok) av_write_trailer(outCtx);
+    av_packet_free(&pkt);
+    if (outCtx->pb) avio_closep(&outCtx->pb);
+    avformat_free_context(outCtx);
+    return ok;
+}
+
+// ============================================================================
+// Command Line
+// ============================================================================
+
+struct Options {
+    EncoderSettings encoder;
+    RenderTarget target;
+    int segments;       // 0 renders the timeline in one serial pass
+    int segmentIndex;   // Only render this segment, -1 for all
+    bool concatOnly;    // Join previously rendered segments and exit
+    int pipelineDepth;  // Frames in flight between render, convert and encode; 0 runs them serially
+    std::string meshPath;   // Model to animate instead of the built-in phone
+    std::string screenPath; // Image or video on the phone's screen, empty for the flat screen
+    int instances;          // Copies of the model on screen, the first one is the original phone path
+    bool frontToBack;       // Draw the nearest instances first
+    std::string frameCache; // Directory of rendered frames to reuse across runs, empty for none
+    std::string output;
+    std::string tracePath;  // Chrome trace of the stage timings, empty for none
+    std::string benchPath;  // Run the benchmarks instead of a job and write their JSON here
+    std::string batchPath;  // Manifest of clips to render in this process, one job per line
+    int batchWorkers;       // Clips rendered at once, 0 for one per budgeted thread
+    int threads;            // Thread budget shared by rendering and encoding, 0 for one per core
+    int encoderThreads;     // Codec threads per encoder, 0 to take the profile's share of the budget
+    std::string regressMode;    // record or check golden frames instead of a job, empty for neither
+    std::string regressDir;
+    int regressTolerance;       // Largest byte difference from a golden frame that still passes
+    double regressThreshold;    // Largest throughput drop from the baseline that passes, in percent
+
+    Options() : target(RENDER_TARGET_RGBA), segments(0), segmentIndex(-1), concatOnly(false), pipelineDepth(3), instances(1),
+                frontToBack(false), output("output_3d.mp4"), batchWorkers(0), threads(0), encoderThreads(0),
+                regressTolerance(0), regressThreshold(10.0) {}
+};
+
+static void printUsage(const char* program) {
+    std::cerr << "Usage: " << program << " [options]\n"
+              << "  --converter builtin|swscale   RGBA to YUV420P conversion path (default builtin)\n"
+              << "  --matrix bt601|bt709          YUV colour matrix (default bt601)\n"
+              << "  --target rgba|yuv             Render into RGBA and convert, or directly into YUV420 (default rgba)\n"
+              << "  --segments N                  Encode the timeline as N GOP-aligned segments in parallel and join them\n"
+              << "  --segment-index K             With --segments, only encode segment K (for distributing across machines)\n"
+              << "  --concat                      With --segments, only join previously encoded segments\n"
+              << "  --pipeline-depth N            Frames in flight between render, convert and encode, 0 for serial (default 3)\n"
+              << "  --mesh PATH                   Animate a .obj, .ply or .vrmesh model instead of the phone\n"
+              << "  --screen FILE                 Show an image or video (looped) on the phone's screen\n"
+              << "  --instances N                 Render a crowd of N copies of the model (default 1)\n"
+              << "  --front-to-back               Draw the nearest instances first so more of the rest is rejected early\n"
+              << "  --frame-cache DIR             Reuse frames rendered by earlier runs from DIR, and add new ones\n"
+              << "  --size WxH                    Output resolution, even sizes up to 8192x8192 (default 1920x1080)\n"
+              << "  --fps N                       Frame rate (default 30)\n"
+              << "  --duration S                  Length in seconds (default 5)\n"
+              << "  --job FILE                    Read options from FILE, one per line, leading dashes optional\n"
+              << "  --output PATH                 Video file or pipe to write, - for stdout (default output_3d.mp4)\n"
+              << "  --container C                 file (by extension), fmp4, ts, y4m or nut; all but file stream,\n"
+              << "                                y4m and nut unencoded (default file, fmp4 for stdout)\n"
+              << "  --batch MANIFEST              Render one clip per manifest line, each line options over these\n"
+              << "  --batch-workers N             Clips rendered at once in batch mode (default one per thread)\n"
+              << "  --profile P                   draft, balanced, archival or low-latency x264 settings (default balanced)\n"
+              << "  --threads N                   Threads shared by rendering and encoding (default one per core)\n"
+              << "  --encoder-threads N           Codec threads per encoder (default the profile's share of --threads)\n"
+              << "  --trace FILE                  Write per-frame stage timings as Chrome trace JSON (chrome://tracing, Perfetto)\n"
+              << "  --bench FILE                  Run the benchmark suite instead and write its results as JSON\n"
+              << "  --regress record|check DIR    Record or check golden frames and render throughput in DIR\n"
+              << "  --regress-tolerance N         Largest per-byte difference from a golden frame that passes (default 0)\n"
+              << "  --regress-threshold PCT       Largest frames/s drop from the recorded baseline that passes (default 10)\n";
+}
+
+// Split a text file into lines of whitespace-separated tokens. # starts a
+// comment; lines left empty are dropped.
+static bool readOptionLines(const std::string& path, std::vector<std::vector<std::string>>& lines,
+                            std::vector<int>* lineNumbers = nullptr) {
+    std::string contents;
+    if (!readFile(path, contents)) return false;
+
+    size_t lineStart = 0;
+    for (int number = 1; lineStart < contents.size(); number++) {
+        size_t lineEnd = contents.find('\n', lineStart);
+        if (lineEnd == std::string::npos) lineEnd = contents.size();
+        std::string line = contents.substr(lineStart, lineEnd - lineStart);
+        lineStart = lineEnd + 1;
+
+        size_t comment = line.find('#');
+        if (comment != std::string::npos) line.resize(comment);
+        std::vector<std::string> tokens;
+        size_t pos = 0;
+        while ((pos = line.find_first_not_of(" \t\r", pos)) != std::string::npos) {
+            size_t tokenEnd = line.find_first_of(" \t\r", pos);
+            if (tokenEnd == std::string::npos) tokenEnd = line.size();
+            tokens.push_back(line.substr(pos, tokenEnd - pos));
+            pos = tokenEnd;
+        }
+        if (tokens.empty()) continue;
+        lines.push_back(tokens);
+        if (lineNumbers) lineNumbers->push_back(number);
+    }
+    return true;
+}
+
+// A job file holds options as on the command line, one per line and with
+// the leading dashes optional
+static bool readJobFile(const std::string& path, std::vector<std::string>& args) {
+    std::vector<std::vector<std::string>> lines;
+    if (!readOptionLines(path, lines)) {
+        std::cerr << "Cannot read job file " << path << std::endl;
+        return false;
+    }
+    for (std::vector<std::string>& line : lines) {
+        if (line[0][0] != '-') line[0] = "--" + line[0];
+        args.insert(args.end(), line.begin(), line.end());
+    }
+    return true;
+}
+
+static bool parseOptions(const std::vector<std::string>& args, Options& options, int jobDepth = 0) {
+    for (size_t i = 0; i < args.size(); i++) {
+        const std::string& arg = args[i];
+        const char* value = (i + 1 < args.size()) ? args[i + 1].c_str() : nullptr;
+
+        if (arg == "--converter" && value) {
+            std::string v = args[++i];
+            if (v == "builtin") options.encoder.converter = CONVERTER_BUILTIN;
+            else if (v == "swscale") options.encoder.converter = CONVERTER_SWSCALE;
+            else return false;
+        } else if (arg == "--container" && value) {
+            std::string v = args[++i];
+            if (v == "file") options.encoder.container = CONTAINER_FILE;
+            else if (v == "fmp4") options.encoder.container = CONTAINER_FRAGMENTED_MP4;
+            else if (v == "ts") options.encoder.container = CONTAINER_MPEGTS;
+            else if (v == "y4m") options.encoder.container = CONTAINER_Y4M;
+            else if (v == "nut") options.encoder.container = CONTAINER_NUT;
+            else return false;
+        } else if (arg == "--profile" && value) {
+            std::string v = args[++i];
+            int count = (int)(sizeof(ENCODER_PROFILES) / sizeof(ENCODER_PROFILES[0]));
+            int profile = 0;
+            while (profile < count && v != ENCODER_PROFILES[profile].name) profile++;
+            if (profile == count) return false;
+            options.encoder.profile = (EncoderProfileId)profile;
+        } else if (arg == "--threads" && value) {
+            options.threads = std::atoi(args[++i].c_str());
+            if (options.threads < 1) return false;
+        } else if (arg == "--encoder-threads" && value) {
+            options.encoderThreads = std::atoi(args[++i].c_str());
+            if (options.encoderThreads < 1) return false;
+        } else if (arg == "--matrix" && value) {
+            std::string v = args[++i];
+            if (v == "bt601") options.encoder.matrix = COLOR_MATRIX_BT601;
+            else if (v == "bt709") options.encoder.matrix = COLOR_MATRIX_BT709;
+            else return false;
+        } else if (arg == "--target" && value) {
+            std::string v = args[++i];
+            if (v == "rgba") options.target = RENDER_TARGET_RGBA;
+            else if (v == "yuv") options.target = RENDER_TARGET_YUV420;
+            else return false;
+        } else if (arg == "--segments" && value) {
+            options.segments = std::atoi(args[++i].c_str());
+            if (options.segments < 1) return false;
+        } else if (arg == "--segment-index" && value) {
+            options.segmentIndex = std::atoi(args[++i].c_str());
+            if (options.segmentIndex < 0) return false;
+        } else if (arg == "--concat") {
+            options.concatOnly = true;
+        } else if (arg == "--pipeline-depth" && value) {
+            options.pipelineDepth = std::atoi(args[++i].c_str());
+            if (options.pipelineDepth < 0) return false;
+        } else if (arg == "--mesh" && value) {
+            options.meshPath = args[++i];
+        } else if (arg == "--screen" && value) {
+            options.screenPath = args[++i];
+        } else if (arg == "--instances" && value) {
+            options.instances = std::atoi(args[++i].c_str());
+            if (options.instances < 1) return false;
+        } else if (arg == "--front-to-back") {
+            options.frontToBack = true;
+        } else if (arg == "--frame-cache" && value) {
+            options.frameCache = args[++i];
+        } else if (arg == "--size" && value) {
+            VideoFormat& format = options.encoder.format;
+            if (std::sscanf(args[++i].c_str(), "%dx%d", &format.width, &format.height) != 2) return false;
+            // YUV420 encoders want whole chroma samples
+            if (format.width < 2 || format.height < 2 || format.width % 2 || format.height % 2) return false;
+            if (format.width > MAX_FRAME_SIZE || format.height > MAX_FRAME_SIZE) return false;
+        } else if (arg == "--fps" && value) {
+            options.encoder.format.fps = std::atoi(args[++i].c_str());
+            if (options.encoder.format.fps < 1) return false;
+        } else if (arg == "--duration" && value) {
+            options.encoder.format.duration = std::atoi(args[++i].c_str());
+            if (options.encoder.format.duration < 1) return false;
+        } else if (arg == "--regress" && i + 2 < args.size()) {
+            options.regressMode = args[++i];
+            options.regressDir = args[++i];
+            if (options.regressMode != "record" && options.regressMode != "check") return false;
+        } else if (arg == "--regress-tolerance" && value) {
+            options.regressTolerance = std::atoi(args[++i].c_str());
+            if (options.regressTolerance < 0) return false;
+        } else if (arg == "--regress-threshold" && value) {
+            options.regressThreshold = std::atof(args[++i].c_str());
+            if (options.regressThreshold < 0.0) return false;
+        } else if (arg == "--bench" && value) {
+            options.benchPath = args[++i];
+        } else if (arg == "--trace" && value) {
+            options.tracePath = args[++i];
+        } else if (arg == "--output" && value) {
+            options.output = args[++i];
+        } else if (arg == "--batch" && value) {
+            options.batchPath = args[++i];
+        } else if (arg == "--batch-workers" && value) {
+            options.batchWorkers = std::atoi(args[++i].c_str());
+            if (options.batchWorkers < 1) return false;
+        } else if (arg == "--job" && value) {
+            std::vector<std::string> jobArgs;
+            if (jobDepth >= 8 || !readJobFile(args[++i], jobArgs)) return false;
+            if (!parseOptions(jobArgs, options, jobDepth + 1)) return false;
+        } else {
+            return false;
+        }
+    }
+    if (jobDepth == 0 && (options.segmentIndex >= 0 || options.concatOnly) && options.segments == 0) return false;
+    // Segments are joined into a seekable file after they are all encoded
+    if (jobDepth == 0 && options.segments > 0 && (options.encoder.container != CONTAINER_FILE || options.output == "-")) {
+        return false;
+    }
+    return true;
+}
+
+// Hero plus crowd as the options describe them
+static void populateScene(Scene& scene, const Options& options) {
+    scene.addHero();
+    addCrowd(scene, options.instances - 1, Renderer::defaultProjection(options.encoder.format.aspect()));
+    scene.frontToBack = options.frontToBack;
+}
+
+// Probe the screen clip, if any. Only meshes with textured faces, like the
+// phone, show it.
+static bool loadScreen(Scene& scene, const Options& options) {
+    if (options.screenPath.empty()) return true;
+    auto clip = std::make_shared<ScreenClip>();
+    if (!clip->probe(options.screenPath, options.encoder.format.fps)) return false;
+    scene.screen = clip;
+    return true;
+}
+
+static int threadBudget(const Options& options) {
+    return options.threads > 0 ? options.threads : ThreadPool::defaultThreadCount();
+}
+
+// Split the thread budget between the render pool and the codec so the two
+// don't oversubscribe the machine. encodes is how many encoders run at once;
+// they share the codec's part. Returns the render pool's size.
+static int splitThreadBudget(Options& options, int budget, int encodes) {
+    EncoderSettings& settings = options.encoder;
+    if (options.encoderThreads > 0) {
+        settings.threads = options.encoderThreads;
+    } else if (settings.passthrough()) {
+        settings.threads = 1;
+    } else {
+        int codecThreads = (int)std::lround(budget * settings.profileInfo().threadShare);
+        settings.threads = std::max(1, codecThreads / encodes);
+    }
+    return std::max(1, budget - settings.threads * encodes);
+}
+
+// Exit summary of the run, plus the trace when one was asked for
+static bool printStats(const Options& options) {
+    printRasterStats();
+    printFrameStats();
+    telemetry.printSummary();
+    if (options.tracePath.empty()) return true;
+    if (!telemetry.writeTrace(options.tracePath)) return false;
+    std::cout << "Trace written to " << options.tracePath << std::endl;
+    return true;
+}
+
+// ============================================================================
+// Batch Jobs
+// ============================================================================
+
+// One clip from a batch manifest
+struct BatchJob {
+    int line;
+    Options options;
+};
+
+// A manifest holds one job per line, written as on the command line and
+// layered over the options the batch itself was started with. # starts a
+// comment. Jobs render whole clips to files, so segment options and stdout
+// output are rejected.
+static bool readManifest(const Options& defaults, std::vector<BatchJob>& jobs) {
+    std::vector<std::vector<std::string>> lines;
+    std::vector<int> lineNumbers;
+    if (!readOptionLines(defaults.batchPath, lines, &lineNumbers)) {
+        std::cerr << "Cannot read batch manifest " << defaults.batchPath << std::endl;
+        return false;
+    }
+
+    std::unordered_map<std::string, int> outputs;
+    for (size_t i = 0; i < lines.size(); i++) {
+        BatchJob job = {lineNumbers[i], defaults};
+        job.options.batchPath.clear();
+        if (!parseOptions(lines[i], job.options, 1) || !job.options.batchPath.empty() || job.options.segments > 0 ||
+            job.options.segmentIndex >= 0 || job.options.concatOnly || job.options.output == "-") {
+            std::cerr << defaults.batchPath << ":" << job.line << ": invalid batch job" << std::endl;
+            return false;
+        }
+        if (job.options.encoderThreads > 0) job.options.encoder.threads = job.options.encoderThreads;
+        auto seen = outputs.emplace(job.options.output, job.line);
+        if (!seen.second) {
+            std::cerr << defaults.batchPath << ":" << job.line << ": " << job.options.output
+                      << " is already written by line " << seen.first->second << std::endl;
+            return false;
+        }
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+// Encode one clip of a batch with the worker's pooled resources
+static bool renderBatchJob(const Options& options, const MeshView& mesh, const Mat4& fit, ThreadPool& pool,
+                           RenderPool& resources) {
+    Scene scene(mesh, fit, options.encoder.format.totalFrames());
+    populateScene(scene, options);
+    if (!loadScreen(scene, options)) return false;
+
+    std::unique_ptr<FrameCache> frameCache;
+    if (!options.frameCache.empty()) {
+        frameCache = std::make_unique<FrameCache>(options.frameCache, scene, options.target, options.encoder);
+        if (!frameCache->open()) return false;
+    }
+
+    VideoEncoder encoder;
+    if (!encoder.init(options.output.c_str(), options.encoder, &pool, resources.acquireScaler(options.encoder))) {
+        return false;
+    }
+    bool ok = encodeFrames(0, options.encoder.format.totalFrames(), scene, encoder, options.target,
+                           options.encoder.matrix, options.pipelineDepth, &pool, frameCache.get(), resources, nullptr);
+    encoder.finish();
+    return ok;
+}
+
+// Render every clip in the manifest. Workers pull jobs in manifest order and
+// keep their framebuffers, frames and scaler between clips; meshes are loaded
+// once and shared by every job that names them.
+static bool runBatch(const Options& options, const MeshView& phoneMesh, ThreadPool& pool) {
+    std::vector<BatchJob> jobs;
+    if (!readManifest(options, jobs)) return false;
+
+    int workerCount = std::max(1, std::min(options.batchWorkers, (int)jobs.size()));
+    std::cout << "Rendering " << jobs.size() << " clips with " << workerCount << " workers on "
+              << pool.getThreadCount() << " threads..." << std::endl;
+
+    std::mutex meshMutex;
+    std::unordered_map<std::string, std::unique_ptr<MeshAsset>> meshes;
+    std::mutex printMutex;
+    std::atomic<int> nextJob(0);
+    std::atomic<int> failed(0);
+    auto batchStart = std::chrono::steady_clock::now();
+
+    auto worker = [&]() {
+        RenderPool resources;
+        for (int i = nextJob++; i < (int)jobs.size(); i = nextJob++) {
+            const Options& job = jobs[i].options;
+            auto start = std::chrono::steady_clock::now();
+            bool ok = true;
+            MeshView mesh = phoneMesh;
+            Mat4 fit;
+            if (!job.meshPath.empty()) {
+                std::lock_guard<std::mutex> lock(meshMutex);
+                std::unique_ptr<MeshAsset>& asset = meshes[job.meshPath];
+                if (!asset) {
+                    asset = std::make_unique<MeshAsset>();
+                    if (!asset->load(job.meshPath)) asset.reset();
+                }
+                if (asset) {
+                    mesh = asset->view();
+                    fit = fitToPhone(mesh);
+                } else {
+                    ok = false;
+                }
+            }
+            if (ok) ok = renderBatchJob(job, mesh, fit, pool, resources);
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+            std::lock_guard<std::mutex> lock(printMutex);
+            if (ok) {
+                const VideoFormat& format = job.encoder.format;
+                std::cout << "Encoded " << job.output << ": " << format.totalFrames() << " frames at "
+                          << format.width << "x" << format.height << " in " << ms << " ms" << std::endl;
+            } else {
+                failed++;
+                std::cerr << "Failed to encode " << job.output << " (" << options.batchPath << ":"
+                          << jobs[i].line << ")" << std::endl;
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (int i = 1; i < workerCount; i++) workers.emplace_back(worker);
+    worker();
+    for (std::thread& thread : workers) thread.join();
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - batchStart).count();
+    bool reported = printStats(options);
+    std::cout << "Batch: " << (jobs.size() - failed) << " of " << jobs.size() << " clips in " << seconds << " s ("
+              << (seconds > 0.0 ? (jobs.size() - failed) * 60.0 / seconds : 0.0) << " clips/min)" << std::endl;
+    return failed == 0 && reported;
+}
+
+// ============================================================================
+// Benchmarks
+// ============================================================================
+
+// Keeps benchmark results observable so the work isn't optimized away
+static volatile float benchSink;
+
+static const int BENCH_SIZES[][2] = {{1280, 720}, {1920, 1080}, {3840, 2160}};
+
+struct BenchResult {
+    std::string name;
+    std::string unit;
+    double value;       // Median over the samples
+    double best;
+    int64_t iterations; // Operations per sample
+};
+
+// Runs each benchmark until a sample takes long enough to time, then keeps
+// the median and best of several samples. fn(n) performs n operations and
+// returns the seconds it spent on them, leaving out its own setup.
+class BenchRunner {
+private:
+    static constexpr double MIN_SAMPLE_SECONDS = 0.02;
+    static const int SAMPLES = 5;
+
+    std::vector<BenchResult> results;
+
 public:
-    VideoEncoder() : fmtCtx(nullptr), codecCtx(nullptr), stream(nullptr),
-                     frame(nullptr), pkt(nullptr), swsCtx(nullptr), frameCount(0) {}
-    
-    bool init(const char* filename) {
-        avformat_alloc_output_context2(&fmtCtx, nullptr, nullptr, filename);
-        if (!fmtCtx) return false;
-        
-        const AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_H264);
-        if (!codec) return false;
-        
-        stream = avformat_new_stream(fmtCtx, nullptr);
-        if (!stream) return false;
-        
-        codecCtx = avcodec_alloc_context3(codec);
-        if (!codecCtx) return false;
-        
-        codecCtx->width = WIDTH;
-        codecCtx->height = HEIGHT;
-        codecCtx->time_base = {1, FPS};
-        codecCtx->framerate = {FPS, 1};
-        codecCtx->pix_fmt = AV_PIX_FMT_YUV420P;
-        codecCtx->gop_size = 10;
-        codecCtx->max_b_frames = 1;
-        
-        av_opt_set(codecCtx->priv_data, "preset", "medium", 0);
-        av_opt_set(codecCtx->priv_data, "crf", "23", 0);
-        
-        if (avcodec_open2(codecCtx, codec, nullptr) < 0) return false;
-        
-        avcodec_parameters_from_context(stream->codecpar, codecCtx);
-        
-        if (!(fmtCtx->oformat->flags & AVFMT_NOFILE)) {
-            if (avio_open(&fmtCtx->pb, filename, AVIO_FLAG_WRITE) < 0) return false;
+    static double secondsSince(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Time per operation, scaled to the unit (1e9 for ns, 1e3 for ms)
+    void measure(const std::string& name, const std::string& unit, double scale,
+                 const std::function<double(int64_t)>& fn) {
+        int64_t n = 1;
+        while (fn(n) < MIN_SAMPLE_SECONDS && n < ((int64_t)1 << 40)) n *= 2;
+
+        std::vector<double> samples;
+        for (int i = 0; i < SAMPLES; i++) samples.push_back(fn(n) / n * scale);
+        std::sort(samples.begin(), samples.end());
+        add({name, unit, samples[SAMPLES / 2], samples[0], n});
+    }
+
+    // Frames per second over one timed run of frames
+    void measureRate(const std::string& name, int frames, const std::function<double()>& fn) {
+        double seconds = fn();
+        double rate = seconds > 0.0 ? frames / seconds : 0.0;
+        add({name, "frames/s", rate, rate, frames});
+    }
+
+    void add(const BenchResult& result) {
+        results.push_back(result);
+        std::cout << "  " << result.name << ": " << result.value << " " << result.unit << " (best " << result.best
+                  << ")" << std::endl;
+    }
+
+    bool writeJson(const std::string& path, const Options& options, int threads) const {
+        FILE* file = std::fopen(path.c_str(), "w");
+        if (!file) {
+            std::cerr << "Cannot write benchmark results " << path << std::endl;
+            return false;
         }
-        
-        if (avformat_write_header(fmtCtx, nullptr) < 0) return false;
-        
-        frame = av_frame_alloc();
-        frame->format = codecCtx->pix_fmt;
-        frame->width = WIDTH;
-        frame->height = HEIGHT;
-        av_frame_get_buffer(frame, 0);
-        
-        pkt = av_packet_alloc();
-        
-        swsCtx = sws_getContext(
-            WIDTH, HEIGHT, AV_PIX_FMT_RGBA,
-            WIDTH, HEIGHT, AV_PIX_FMT_YUV420P,
-            SWS_BILINEAR, nullptr, nullptr, nullptr
-        );
-        
-        return true;
+        std::fprintf(file, "{\n  \"rasterKernel\": \"%s\",\n  \"threads\": %d,\n  \"profile\": \"%s\",\n"
+                     "  \"benchmarks\": [\n", triangleKernelName(triangleKernel), threads,
+                     options.encoder.profileInfo().name);
+        for (size_t i = 0; i < results.size(); i++) {
+            const BenchResult& r = results[i];
+            std::fprintf(file, "    {\"name\": \"%s\", \"unit\": \"%s\", \"value\": %.6g, \"best\": %.6g, "
+                         "\"iterations\": %lld}%s\n", r.name.c_str(), r.unit.c_str(), r.value, r.best,
+                         (long long)r.iterations, i + 1 < results.size() ? "," : "");
+        }
+        std::fprintf(file, "  ]\n}\n");
+        return std::fclose(file) == 0;
     }
-    
-    void writeFrame(const Framebuffer& fb) {
-        const Color* pixels = fb.getData();
-        
-        // Convert RGBA to YUV420P
-        std::vector<uint8_t> rgbaData(WIDTH * HEIGHT * 4);
-        for (int i = 0; i < WIDTH * HEIGHT; i++) {
-            rgbaData[i * 4 + 0] = pixels[i].r;
-            rgbaData[i * 4 + 1] = pixels[i].g;
-            rgbaData[i * 4 + 2] = pixels[i].b;
-            rgbaData[i * 4 + 3] = pixels[i].a;
+};
+
+static void benchMath(BenchRunner& bench) {
+    bench.measure("mat4.multiply", "ns/op", 1e9, [](int64_t n) {
+        Mat4 step = Mat4::rotationY(0.001f) * Mat4::rotationX(0.002f);
+        Mat4 m;
+        auto start = std::chrono::steady_clock::now();
+        for (int64_t i = 0; i < n; i++) m = m * step;
+        double seconds = BenchRunner::secondsSince(start);
+        benchSink = m.m[0][0];
+        return seconds;
+    });
+
+    std::vector<Vec4> points(1024);
+    for (size_t i = 0; i < points.size(); i++) points[i] = Vec4((float)i, (float)(i * 7 % 13), (float)(i % 5));
+    bench.measure("mat4.transform", "ns/op", 1e9, [&points](int64_t n) {
+        Mat4 mvp = Renderer::defaultProjection(16.0f / 9.0f) * Mat4::translation(0.0f, 0.0f, -5.0f);
+        float sum = 0.0f;
+        auto start = std::chrono::steady_clock::now();
+        for (int64_t i = 0; i < n; i++) {
+            Vec4 p = mvp * points[i & 1023];
+            sum += p.x + p.w;
         }
-        
-        const uint8_t* srcData[4] = { rgbaData.data(), nullptr, nullptr, nullptr };
-        int srcLinesize[4] = { WIDTH * 4, 0, 0, 0 };
-        
-        sws_scale(swsCtx, srcData, srcLinesize, 0, HEIGHT, frame->data, frame->linesize);
-        
-        frame->pts = frameCount++;
-        
-        avcodec_send_frame(codecCtx, frame);
-        
-        while (avcodec_receive_packet(codecCtx, pkt) == 0) {
-            av_packet_rescale_ts(pkt, codecCtx->time_base, stream->time_base);
-            pkt->stream_index = stream->index;
-            av_interleaved_write_frame(fmtCtx, pkt);
-            av_packet_unref(pkt);
+        double seconds = BenchRunner::secondsSince(start);
+        benchSink = sum;
+        return seconds;
+    });
+}
+
+// Single-threaded triangles and lines of a given size and aspect, spread over
+// a 1080p framebuffer. Each batch draws nearer than the last so every
+// primitive passes the depth test; the clear between batches is not timed.
+static void benchRaster(BenchRunner& bench) {
+    Framebuffer framebuffer(1920, 1080);
+    Renderer renderer(framebuffer);
+    const int BATCH = 256;
+    Mat4 identity;
+
+    auto drawBatches = [&](int64_t n, float w, float h, const RasterState& state) {
+        double seconds = 0.0;
+        float sx = 2.0f * w / framebuffer.getWidth(), sy = 2.0f * h / framebuffer.getHeight();
+        for (int64_t done = 0; done < n; done += BATCH) {
+            framebuffer.clear(BACKGROUND_COLOR);
+            int count = (int)std::min<int64_t>(BATCH, n - done);
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < count; i++) {
+                float x = -0.9f + 1.6f * (float)((i * 37) % BATCH) / BATCH;
+                float y = -0.9f + 1.6f * (float)((i * 91) % BATCH) / BATCH;
+                float z = 0.9f - 1.8f * (float)i / BATCH;
+                renderer.drawTriangle(Vec3(x, y, z), Vec3(x + sx, y, z), Vec3(x, y + sy, z), identity,
+                                      Color(40, 120, 200), state);
+            }
+            renderer.flush();
+            seconds += BenchRunner::secondsSince(start);
         }
+        return seconds;
+    };
+
+    struct Shape { const char* name; float w, h; };
+    const Shape shapes[] = {{"4px", 4, 4}, {"32px", 32, 32}, {"256px", 256, 256}, {"32px.thin", 128, 8},
+                            {"256px.thin", 1024, 64}};
+    for (const Shape& shape : shapes) {
+        bench.measure(std::string("raster.triangle.") + shape.name, "ns/op", 1e9,
+                      [&](int64_t n) { return drawBatches(n, shape.w, shape.h, RasterState()); });
     }
-    
-    void finish() {
-        avcodec_send_frame(codecCtx, nullptr);
-        
-        AVPacket* pkt = av_packet_alloc();
-        while (avcodec_receive_packet(codecCtx, pkt) == 0) {
-            av_packet_rescale_ts(pkt, codecCtx->time_base, stream->time_base);
-            pkt->stream_index = stream->index;
-            av_interleaved_write_frame(fmtCtx, pkt);
-            av_packet_unref(pkt);
+    // A wireframe triangle is three lines
+    RasterState wireframe;
+    wireframe.fill = FILL_WIREFRAME;
+    bench.measure("raster.line.64px", "ns/op", 1e9 / 3.0,
+                  [&](int64_t n) { return drawBatches(n, 64, 64, wireframe); });
+
+    // Debug overlay of a dense mesh: a rippled 256x256 quad grid drawn from its edge list
+    const int GRID = 256;
+    Mesh grid;
+    for (int y = 0; y <= GRID; y++) {
+        for (int x = 0; x <= GRID; x++) {
+            grid.addVertex(Vec3((float)x / GRID - 0.5f, (float)y / GRID - 0.5f, 0.1f * std::sin(x * 0.2f) * std::cos(y * 0.15f)));
+        }
+    }
+    for (int y = 0; y < GRID; y++) {
+        for (int x = 0; x < GRID; x++) {
+            uint32_t a = y * (GRID + 1) + x, b = a + 1, c = a + GRID + 1, d = c + 1;
+            grid.addTriangle(a, b, d, Color(200, 200, 200));
+            grid.addTriangle(a, d, c, Color(200, 200, 200));
+        }
+    }
+    grid.buildEdges();
+    MeshView gridView = grid.view();
+    Mat4 gridMvp = renderer.getProjectionMatrix() * Mat4::translation(0.0f, 0.0f, -1.2f) * Mat4::rotationX(-0.6f);
+    bench.measure("raster.wireframe.grid", "ms/frame", 1e3, [&](int64_t n) {
+        auto start = std::chrono::steady_clock::now();
+        for (int64_t i = 0; i < n; i++) {
+            framebuffer.clear(BACKGROUND_COLOR);
+            renderer.drawMesh(gridView, gridMvp, wireframe);
+            renderer.flush();
+        }
+        return BenchRunner::secondsSince(start);
+    });
+
+    // A screen-sized texture on a tilted, rolled quad covering most of the frame
+    const int TEXTURE_SIZE = 1024;
+    std::vector<uint8_t> checker((size_t)TEXTURE_SIZE * TEXTURE_SIZE * 4);
+    for (int y = 0; y < TEXTURE_SIZE; y++) {
+        for (int x = 0; x < TEXTURE_SIZE; x++) {
+            uint8_t* texel = &checker[((size_t)y * TEXTURE_SIZE + x) * 4];
+            texel[0] = (uint8_t)x;
+            texel[1] = (uint8_t)y;
+            texel[2] = ((x ^ y) & 32) ? 255 : 0;
+            texel[3] = 255;
+        }
+    }
+    Texture texture;
+    texture.create(TEXTURE_SIZE, TEXTURE_SIZE);
+    texture.upload(checker.data(), TEXTURE_SIZE * 4);
+
+    Mesh quad;
+    const float corners[4][2] = {{-1, -1}, {1, -1}, {1, 1}, {-1, 1}};
+    for (uint32_t i = 0; i < 4; i++) {
+        quad.addVertex(Vec3(corners[i][0], corners[i][1], 0));
+        quad.setTexCoord(i, (corners[i][0] + 1) * 0.5f, (1 - corners[i][1]) * 0.5f);
+    }
+    quad.addTriangle(0, 1, 2, Color(26, 32, 44));
+    quad.addTriangle(0, 2, 3, Color(26, 32, 44));
+    quad.setTextured(0);
+    quad.setTextured(1);
+    RasterState textured;
+    textured.texture = &texture;
+    Mat4 quadMvp = renderer.getProjectionMatrix() * Mat4::translation(0.0f, 0.0f, -2.2f) * Mat4::rotationZ(0.5f) *
+                   Mat4::rotationX(-0.7f);
+    bench.measure("raster.textured.quad", "ms/frame", 1e3, [&](int64_t n) {
+        auto start = std::chrono::steady_clock::now();
+        for (int64_t i = 0; i < n; i++) {
+            framebuffer.clear(BACKGROUND_COLOR);
+            renderer.drawMesh(quad.view(), quadMvp, textured);
+            renderer.flush();
+        }
+        return BenchRunner::secondsSince(start);
+    });
+}
+
+static void benchFrameOps(BenchRunner& bench, ThreadPool& pool) {
+    for (const int* dimensions : BENCH_SIZES) {
+        VideoFormat format;
+        format.width = dimensions[0];
+        format.height = dimensions[1];
+        std::string size = std::to_string(format.height) + "p";
+        Framebuffer framebuffer(format.width, format.height);
+
+        // Everything drawn, so each clear repaints the whole frame
+        bench.measure("framebuffer.clear." + size, "ms/frame", 1e3, [&](int64_t n) {
+            auto start = std::chrono::steady_clock::now();
+            for (int64_t i = 0; i < n; i++) {
+                framebuffer.markDrawn(framebuffer.bounds());
+                framebuffer.clear(BACKGROUND_COLOR);
+            }
+            return BenchRunner::secondsSince(start);
+        });
+
+        AVFrame* frame = av_frame_alloc();
+        frame->format = AV_PIX_FMT_YUV420P;
+        frame->width = format.width;
+        frame->height = format.height;
+        if (av_frame_get_buffer(frame, 0) < 0) {
+            av_frame_free(&frame);
+            continue;
+        }
+        const uint8_t* rgba = reinterpret_cast<const uint8_t*>(framebuffer.getData());
+        int rgbaStride = format.width * (int)sizeof(Color);
+
+        YuvConverter serial(COLOR_MATRIX_BT601);
+        YuvConverter parallel(COLOR_MATRIX_BT601, &pool);
+        const YuvConverter* converters[] = {&serial, &parallel};
+        const char* names[] = {"convert.builtin.", "convert.builtin.pool."};
+        for (int i = 0; i < 2; i++) {
+            bench.measure(names[i] + size, "ms/frame", 1e3, [&](int64_t n) {
+                auto start = std::chrono::steady_clock::now();
+                for (int64_t k = 0; k < n; k++) {
+                    converters[i]->convert(rgba, rgbaStride, format.width, format.height, frame->data, frame->linesize);
+                }
+                return BenchRunner::secondsSince(start);
+            });
+        }
+
+        SwsContext* sws = sws_getContext(format.width, format.height, AV_PIX_FMT_RGBA, format.width, format.height,
+                                         AV_PIX_FMT_YUV420P, SWS_BILINEAR, nullptr, nullptr, nullptr);
+        if (sws) {
+            bench.measure("convert.swscale." + size, "ms/frame", 1e3, [&](int64_t n) {
+                const uint8_t* srcData[4] = {rgba, nullptr, nullptr, nullptr};
+                int srcLinesize[4] = {rgbaStride, 0, 0, 0};
+                auto start = std::chrono::steady_clock::now();
+                for (int64_t k = 0; k < n; k++) {
+                    sws_scale(sws, srcData, srcLinesize, 0, format.height, frame->data, frame->linesize);
+                }
+                return BenchRunner::secondsSince(start);
+            });
+            sws_freeContext(sws);
         }
-        av_packet_free(&pkt);
-        
-        av_write_trailer(fmtCtx);
-        
-        avcodec_free_context(&codecCtx);
         av_frame_free(&frame);
-        av_packet_free(&this->pkt);
-        sws_freeContext(swsCtx);
-        
-        if (!(fmtCtx->oformat->flags & AVFMT_NOFILE)) {
-            avio_closep(&fmtCtx->pb);
+    }
+}
+
+// Encode-only throughput of each profile on rendered 1080p frames, and
+// render plus encode throughput of a fixed crowd at three sizes. Both write
+// to a scratch file next to the results.
+static void benchEncode(BenchRunner& bench, const Options& options, const MeshView& mesh, ThreadPool& pool) {
+    const std::string scratch = options.benchPath + ".scratch.mp4";
+    const int FRAMES = 60;
+    RenderPool resources;
+
+    EncoderSettings settings = options.encoder;
+    settings.format = VideoFormat();
+    settings.format.duration = FRAMES / settings.format.fps;
+    Scene scene(mesh, Mat4(), settings.format.totalFrames());
+    populateScene(scene, options);
+
+    // A second of distinct frames, cycled
+    std::vector<AVFrame*> frames;
+    {
+        VideoEncoder sizing;
+        if (!sizing.init(scratch.c_str(), settings, &pool)) return;
+        RenderPool::Target target = resources.acquireTarget(settings.format, RENDER_TARGET_RGBA, settings.matrix, &pool);
+        SceneScratch scratch;
+        for (int i = 0; i < settings.format.fps; i++) {
+            AVFrame* frame = sizing.allocFrame();
+            if (!frame) break;
+            const std::vector<Mat4>& draws = composeScene(scene, i * 2, target.renderer->getProjectionMatrix(), &pool, scratch);
+            drawFrame(draws, scene, *target.framebuffer, *target.renderer, i * 2);
+            Rect drawn = target.framebuffer->bounds();
+            sizing.convertFrame(*target.framebuffer, frame, drawn);
+            frames.push_back(frame);
         }
-        
-        avformat_free_context(fmtCtx);
+        sizing.finish();
+        resources.releaseTarget(std::move(target));
+    }
+
+    int profiles = (int)(sizeof(ENCODER_PROFILES) / sizeof(ENCODER_PROFILES[0]));
+    for (int profile = 0; profile < profiles && !frames.empty(); profile++) {
+        EncoderSettings profiled = settings;
+        profiled.profile = (EncoderProfileId)profile;
+        bench.measureRate(std::string("encode.") + ENCODER_PROFILES[profile].name + ".1080p", FRAMES, [&] {
+            VideoEncoder encoder;
+            if (!encoder.init(scratch.c_str(), profiled, &pool)) return 0.0;
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < FRAMES; i++) encoder.encodeFrame(frames[i % frames.size()]);
+            encoder.finish();
+            return BenchRunner::secondsSince(start);
+        });
+    }
+    for (AVFrame* frame : frames) av_frame_free(&frame);
+
+    for (const int* size : BENCH_SIZES) {
+        EncoderSettings sized = settings;
+        sized.format.width = size[0];
+        sized.format.height = size[1];
+        Options sceneOptions = options;
+        sceneOptions.encoder = sized;
+        Scene sizedScene(mesh, Mat4(), sized.format.totalFrames());
+        populateScene(sizedScene, sceneOptions);
+
+        bench.measureRate("e2e." + std::to_string(size[1]) + "p", FRAMES, [&] {
+            VideoEncoder encoder;
+            if (!encoder.init(scratch.c_str(), sized, &pool, resources.acquireScaler(sized))) return 0.0;
+            auto start = std::chrono::steady_clock::now();
+            encodeFrames(0, FRAMES, sizedScene, encoder, options.target, sized.matrix, options.pipelineDepth, &pool,
+                         nullptr, resources, nullptr);
+            encoder.finish();
+            return BenchRunner::secondsSince(start);
+        });
     }
+    std::remove(scratch.c_str());
+}
+
+// Fixed workloads, independent of the job options except the encoder
+// profile, target and pipeline depth the end-to-end runs use
+static bool runBenchmarks(const Options& options, const MeshView& mesh, ThreadPool& pool) {
+    std::cout << "Benchmarking on " << pool.getThreadCount() << " threads (" << triangleKernelName(triangleKernel)
+              << " raster kernel)..." << std::endl;
+    BenchRunner bench;
+    benchMath(bench);
+    benchRaster(bench);
+    benchFrameOps(bench, pool);
+    benchEncode(bench, options, mesh, pool);
+    if (!bench.writeJson(options.benchPath, options, pool.getThreadCount())) return false;
+    std::cout << "Results written to " << options.benchPath << std::endl;
+    return true;
+}
+
+// ============================================================================
+// Regression
+// ============================================================================
+
+// Deterministic scenes whose raw frames, before any encoding, are compared
+// against golden data recorded by an earlier build
+struct RegressScene {
+    const char* name;
+    int instances;
+    bool frontToBack;
+    RenderTarget target;
+    int minThreads;     // Render on a pool of at least this many threads, whatever --threads says
+};
+
+// The stress scenes span several compose chunks and always have pool
+// workers, so the parallel compose and cull path runs even on one core
+static const RegressScene REGRESS_SCENES[] = {
+    {"phone", 1, false, RENDER_TARGET_RGBA, 1},
+    {"phone-yuv", 1, false, RENDER_TARGET_YUV420, 1},
+    {"crowd", 200, false, RENDER_TARGET_RGBA, 1},
+    {"crowd-front-to-back", 200, true, RENDER_TARGET_RGBA, 1},
+    {"crowd-yuv", 200, false, RENDER_TARGET_YUV420, 1},
+    {"stress", 3000, false, RENDER_TARGET_RGBA, 4},
+    {"stress-front-to-back", 3000, true, RENDER_TARGET_RGBA, 4},
+};
+
+static const char GOLDEN_FILE_MAGIC[8] = {'V', 'R', 'G', 'O', 'L', 'D', 'E', 'N'};
+static const uint32_t GOLDEN_FILE_VERSION = 1;
+
+// Followed per frame by its hash, its packed size and its raw bytes as one
+// PackBits run
+struct GoldenFileHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t width, height, fps, frames;
+    uint32_t rawSize;           // Bytes per raw frame
+    double framesPerSecond;     // Render throughput when recorded, the performance baseline
 };
 
+// The frame as the renderer left it: the RGBA channels one after another,
+// which PackBits compresses far better than interleaved pixels, or the Y, U
+// and V rows
+static void captureFrame(const Framebuffer& framebuffer, const AVFrame* planes, std::string& raw) {
+    raw.clear();
+    int width = framebuffer.getWidth(), height = framebuffer.getHeight();
+    if (framebuffer.getTarget() == RENDER_TARGET_RGBA) {
+        size_t pixels = (size_t)width * height;
+        raw.resize(pixels * sizeof(Color));
+        const uint8_t* rgba = reinterpret_cast<const uint8_t*>(framebuffer.getData());
+        for (size_t i = 0; i < pixels; i++) {
+            for (int channel = 0; channel < 4; channel++) raw[channel * pixels + i] = (char)rgba[i * 4 + channel];
+        }
+        return;
+    }
+    for (int plane = 0; plane < 3; plane++) {
+        int shift = plane ? 1 : 0;
+        for (int y = 0; y < (height + shift) >> shift; y++) {
+            raw.append(reinterpret_cast<const char*>(planes->data[plane] + (size_t)y * planes->linesize[plane]),
+                       (width + shift) >> shift);
+        }
+    }
+}
+
+// Render one scene, recording its frames as golden data or checking them
+// against it. A check renders at the recorded format, passes frames whose
+// bytes all lie within tolerance of the golden ones, and fails if render
+// throughput dropped by more than the regression threshold.
+static bool runRegressScene(const RegressScene& regress, const Options& options, const MeshView& mesh,
+                            ThreadPool& sharedPool, bool record) {
+    std::string path = options.regressDir + "/" + regress.name + ".golden";
+    std::string golden;
+    GoldenFileHeader header = {};
+    VideoFormat format = options.encoder.format;
+    if (!record) {
+        if (!readFile(path, golden) || golden.size() < sizeof(header)) {
+            std::cerr << "  " << regress.name << ": no golden data at " << path << std::endl;
+            return false;
+        }
+        std::memcpy(&header, golden.data(), sizeof(header));
+        if (std::memcmp(header.magic, GOLDEN_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != GOLDEN_FILE_VERSION) {
+            std::cerr << "  " << regress.name << ": " << path << " is not golden data" << std::endl;
+            return false;
+        }
+        format.width = header.width;
+        format.height = header.height;
+        format.fps = header.fps;
+        format.duration = header.frames / std::max(1, header.fps);
+    }
+
+    Options sceneOptions = options;
+    sceneOptions.encoder.format = format;
+    sceneOptions.instances = regress.instances;
+    sceneOptions.frontToBack = regress.frontToBack;
+    int frames = format.totalFrames();
+    Scene scene(mesh, Mat4(), frames);
+    populateScene(scene, sceneOptions);
+
+    std::unique_ptr<ThreadPool> ownPool;
+    if (sharedPool.getThreadCount() < regress.minThreads) ownPool = std::make_unique<ThreadPool>(regress.minThreads);
+    ThreadPool& pool = ownPool ? *ownPool : sharedPool;
+
+    Framebuffer framebuffer(format.width, format.height, regress.target, options.encoder.matrix);
+    Renderer renderer(framebuffer, &pool);
+    AVFrame* planes = nullptr;
+    if (regress.target == RENDER_TARGET_YUV420) {
+        planes = av_frame_alloc();
+        planes->format = AV_PIX_FMT_YUV420P;
+        planes->width = format.width;
+        planes->height = format.height;
+        if (av_frame_get_buffer(planes, 0) < 0) av_frame_free(&planes);
+        if (!planes) return false;
+    }
+
+    std::string raw, packed, expected;
+    std::string recorded(sizeof(header), '\0');
+    size_t offset = sizeof(header);
+    Rect planesDrawn = framebuffer.bounds();
+    SceneScratch scratch;
+    double renderSeconds = 0.0;
+    int mismatched = 0, firstMismatch = -1, worstDifference = 0;
+    bool ok = true;
+
+    auto renderFrame = [&](int frameNum) {
+        auto start = std::chrono::steady_clock::now();
+        if (planes) framebuffer.bindYuvTarget(planes->data, planes->linesize, planesDrawn);
+        drawFrame(composeScene(scene, frameNum, renderer.getProjectionMatrix(), &pool, scratch), scene, framebuffer,
+                  renderer, frameNum);
+        planesDrawn = framebuffer.getDrawn();
+        return BenchRunner::secondsSince(start);
+    };
+
+    for (int frameNum = 0; frameNum < frames && ok; frameNum++) {
+        renderSeconds += renderFrame(frameNum);
+        captureFrame(framebuffer, planes, raw);
+        uint64_t hash = hashBytes(raw.data(), raw.size(), 0);
+        if (record) {
+            packed.clear();
+            packBitsRow(reinterpret_cast<const uint8_t*>(raw.data()), (int)raw.size(), packed);
+            uint64_t sizes[2] = {hash, packed.size()};
+            recorded.append(reinterpret_cast<const char*>(sizes), sizeof(sizes));
+            recorded.append(packed);
+            continue;
+        }
+
+        uint64_t sizes[2];
+        if (raw.size() != header.rawSize || golden.size() - offset < sizeof(sizes)) {
+            ok = false;
+            break;
+        }
+        std::memcpy(sizes, golden.data() + offset, sizeof(sizes));
+        offset += sizeof(sizes);
+        if (golden.size() - offset < sizes[1]) {
+            ok = false;
+            break;
+        }
+        const uint8_t* in = reinterpret_cast<const uint8_t*>(golden.data()) + offset;
+        offset += sizes[1];
+        if (hash == sizes[0]) continue;
+
+        expected.resize(raw.size());
+        if (!unpackBitsRow(in, in + sizes[1], reinterpret_cast<uint8_t*>(&expected[0]), (int)expected.size())) {
+            ok = false;
+            break;
+        }
+        int difference = 0;
+        for (size_t i = 0; i < raw.size(); i++) {
+            difference = std::max(difference, std::abs((int)(uint8_t)raw[i] - (int)(uint8_t)expected[i]));
+        }
+        worstDifference = std::max(worstDifference, difference);
+        if (difference > options.regressTolerance) {
+            mismatched++;
+            if (firstMismatch < 0) firstMismatch = frameNum;
+        }
+    }
+    // Short scenes are timed over more passes, keeping the fastest, so
+    // scheduling noise doesn't read as a regression
+    double timedSeconds = renderSeconds;
+    for (int pass = 1; ok && pass < 20 && timedSeconds < 1.0; pass++) {
+        double passSeconds = 0.0;
+        for (int frameNum = 0; frameNum < frames; frameNum++) passSeconds += renderFrame(frameNum);
+        renderSeconds = std::min(renderSeconds, passSeconds);
+        timedSeconds += passSeconds;
+    }
+    if (planes) av_frame_free(&planes);
+    if (!ok) {
+        std::cerr << "  " << regress.name << ": " << path << " is truncated or from another format" << std::endl;
+        return false;
+    }
+
+    double framesPerSecond = renderSeconds > 0.0 ? frames / renderSeconds : 0.0;
+    std::cout << "  " << regress.name << ": " << frames << " frames at " << format.width << "x" << format.height
+              << " in " << renderSeconds * 1e3 << " ms, " << framesPerSecond << " frames/s";
+
+    if (record) {
+        header = {};
+        std::memcpy(header.magic, GOLDEN_FILE_MAGIC, sizeof(header.magic));
+        header.version = GOLDEN_FILE_VERSION;
+        header.width = format.width;
+        header.height = format.height;
+        header.fps = format.fps;
+        header.frames = frames;
+        header.rawSize = (uint32_t)raw.size();
+        header.framesPerSecond = framesPerSecond;
+        recorded.replace(0, sizeof(header), reinterpret_cast<const char*>(&header), sizeof(header));
+        FILE* file = std::fopen(path.c_str(), "wb");
+        bool written = file && std::fwrite(recorded.data(), 1, recorded.size(), file) == recorded.size();
+        if (file && std::fclose(file) != 0) written = false;
+        std::cout << (written ? ", recorded" : "") << std::endl;
+        if (!written) std::cerr << "Cannot write " << path << std::endl;
+        return written;
+    }
+
+    double floor = header.framesPerSecond * (1.0 - options.regressThreshold / 100.0);
+    bool fast = framesPerSecond >= floor;
+    std::cout << " (baseline " << header.framesPerSecond << ")";
+    if (mismatched > 0) {
+        std::cout << ", FAILED: " << mismatched << " frames differ by up to " << worstDifference << ", first at frame "
+                  << firstMismatch;
+    } else if (worstDifference > 0) {
+        std::cout << ", frames within tolerance (largest difference " << worstDifference << ")";
+    } else {
+        std::cout << ", frames identical";
+    }
+    if (!fast) std::cout << ", FAILED: below the " << floor << " frames/s threshold";
+    std::cout << std::endl;
+    return mismatched == 0 && fast;
+}
+
+static bool runRegression(const Options& options, const MeshView& mesh, ThreadPool& pool) {
+    bool record = options.regressMode == "record";
+    if (record && mkdir(options.regressDir.c_str(), 0755) != 0 && errno != EEXIST) {
+        std::cerr << "Cannot create " << options.regressDir << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    std::cout << (record ? "Recording" : "Checking") << " golden frames in " << options.regressDir << " on "
+              << pool.getThreadCount() << " threads (" << triangleKernelName(triangleKernel) << " raster kernel)..."
+              << std::endl;
+
+    int failed = 0;
+    for (const RegressScene& regress : REGRESS_SCENES) {
+        if (!runRegressScene(regress, options, mesh, pool, record)) failed++;
+    }
+    if (!record) {
+        int count = (int)(sizeof(REGRESS_SCENES) / sizeof(REGRESS_SCENES[0]));
+        std::cout << (count - failed) << " of " << count << " scenes passed" << std::endl;
+    }
+    return failed == 0;
+}
+
 // ============================================================================
 // Main
 // ============================================================================
 
-int main() {
+int main(int argc, char** argv) {
+    Options options;
+    if (!parseOptions(std::vector<std::string>(argv + 1, argv + argc), options)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    // The video owns stdout, so progress goes to stderr
+    if (options.output == "-") std::cout.rdbuf(std::cerr.rdbuf());
+
     std::cout << "Initializing 3D phone renderer..." << std::endl;
     
-    Framebuffer framebuffer(WIDTH, HEIGHT);
-    Renderer renderer(framebuffer);
+    int budget = threadBudget(options);
+    int encodes = 1;
+    if (!options.batchPath.empty()) {
+        if (options.batchWorkers == 0) options.batchWorkers = budget;
+        encodes = options.batchWorkers;
+    } else if (options.segments > 0 && options.segmentIndex < 0 && !options.concatOnly) {
+        encodes = std::min(options.segments, budget);
+    }
+    ThreadPool pool(splitThreadBudget(options, budget, encodes));
+
     Phone phone(1.0f, 2.0f, 0.15f);  // Width, Height, Thickness - iPhone proportions
+    if (!options.benchPath.empty()) return runBenchmarks(options, phone.mesh.view(), pool) ? 0 : 1;
+    if (!options.regressMode.empty()) return runRegression(options, phone.mesh.view(), pool) ? 0 : 1;
+    if (!options.batchPath.empty()) return runBatch(options, phone.mesh.view(), pool) ? 0 : 1;
+
+    MeshAsset asset;
+    MeshView mesh = phone.mesh.view();
+    Mat4 fit;
+    if (!options.meshPath.empty()) {
+        auto start = std::chrono::steady_clock::now();
+        if (!asset.load(options.meshPath)) return 1;
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        mesh = asset.view();
+        fit = fitToPhone(mesh);
+        std::cout << "Loaded " << options.meshPath << ": " << mesh.triangleCount << " triangles, "
+                  << mesh.vertexCount << " vertices in " << ms << " ms" << std::endl;
+    }
+
+    const VideoFormat& format = options.encoder.format;
+    Scene scene(mesh, fit, format.totalFrames());
+    populateScene(scene, options);
+    if (!loadScreen(scene, options)) return 1;
+
+    std::unique_ptr<FrameCache> frameCache;
+    if (!options.frameCache.empty()) {
+        frameCache = std::make_unique<FrameCache>(options.frameCache, scene, options.target, options.encoder);
+        if (!frameCache->open()) return 1;
+    }
+
+    if (options.segments > 0) {
+        std::vector<Segment> segments = planSegments(options.segments, options.encoder.gop(), format.totalFrames(),
+                                                     options.output);
+
+        if (!options.concatOnly) {
+            std::vector<Segment> selected;
+            for (const Segment& segment : segments) {
+                if (options.segmentIndex < 0 || options.segmentIndex == segment.index) selected.push_back(segment);
+            }
+            if (selected.empty()) {
+                std::cerr << "No segment " << options.segmentIndex << " (timeline has " << segments.size() << ")" << std::endl;
+                return 1;
+            }
+
+            std::cout << "Encoding " << selected.size() << " of " << segments.size() << " segments with "
+                      << encodes << " workers on " << pool.getThreadCount() << " threads..." << std::endl;
+            if (!encodeSegments(selected, encodes, scene, options.target, options.encoder,
+                                options.pipelineDepth, &pool, frameCache.get())) return 1;
+            if (options.segmentIndex >= 0) return printStats(options) ? 0 : 1;
+        }
+
+        std::cout << "Joining " << segments.size() << " segments..." << std::endl;
+        if (!concatSegments(segments, format.fps, options.output.c_str())) {
+            std::cerr << "Failed to join segments" << std::endl;
+            return 1;
+        }
+        for (const Segment& segment : segments) std::remove(segment.path.c_str());
+        if (!printStats(options)) return 1;
+        std::cout << "Video saved as " << options.output << std::endl;
+        return 0;
+    }
+
+    RenderPool resources;
     VideoEncoder encoder;
     
-    if (!encoder.init("output_3d.mp4")) {
+    if (!encoder.init(options.output.c_str(), options.encoder, &pool, resources.acquireScaler(options.encoder))) {
         std::cerr << "Failed to initialize encoder" << std::endl;
         return 1;
     }
     
-    std::cout << "Rendering " << TOTAL_FRAMES << " frames..." << std::endl;
+    std::cout << "Rendering " << format.totalFrames() << " frames at " << format.width << "x" << format.height
+              << " on " << pool.getThreadCount() << " threads ("
+              << triangleKernelName(triangleKernel) << " raster kernel, "
+              << (options.encoder.passthrough() ? "passthrough" : options.encoder.profileInfo().name) << " encoder on "
+              << options.encoder.threads << " threads)..." << std::endl;
     std::cout << "Phone traveling across screen with 3D rotation!" << std::endl;
     
-    for (int frameNum = 0; frameNum < TOTAL_FRAMES; frameNum++) {
-        float t = (float)frameNum / (float)TOTAL_FRAMES;
-        
-        // Clear framebuffer with white background (like original)
-        framebuffer.clear(Color(255, 255, 255));
-        
-        // Screen crossing movement (left to right)
-        float screen_width_world = 12.0f;  // World space width
-        float x_pos = -screen_width_world/2 + t * screen_width_world;  // Move left to right
-        
-        // 3D rotation for dynamic effect
-        float angle = t * 2.0f * PI;
-        Mat4 rotationX = Mat4::rotationX(angle * 0.8f);   // Flip/tumble effect
-        Mat4 rotationY = Mat4::rotationY(angle * 1.2f);   // Spin around vertical axis
-        Mat4 rotationZ = Mat4::rotationZ(angle * 0.4f);   // Roll effect
-        
-        // Position phone in 3D space
-        Mat4 translation = Mat4::translation(x_pos, 0, -8.0f);  // Move across screen, away from camera
-        
-        // Combine transformations: Translate * RotateZ * RotateY * RotateX
-        // Order matters! We want to rotate first, then translate
-        Mat4 modelMatrix = translation * rotationZ * rotationY * rotationX;
-        
-        // Render phone
-        phone.render(renderer, modelMatrix, false);
-        
-        // Encode frame
-        encoder.writeFrame(framebuffer);
-        
+    int totalFrames = format.totalFrames();
+    auto reportProgress = [totalFrames](int frameNum) {
         if (frameNum % 10 == 0) {
-            std::cout << "Progress: " << frameNum << "/" << TOTAL_FRAMES << " frames" << std::endl;
-            std::cout << "Phone position: " << x_pos << " (screen progression: " << (t * 100.0f) << "%)" << std::endl;
+            FrameScene scene = animateFrame(frameNum, totalFrames);
+            std::cout << "Progress: " << frameNum << "/" << totalFrames << " frames" << std::endl;
+            std::cout << "Phone position: " << scene.xPos << " (screen progression: " << (scene.t * 100.0f) << "%)" << std::endl;
         }
+    };
+    
+    if (!encodeFrames(0, totalFrames, scene, encoder, options.target, options.encoder.matrix,
+                      options.pipelineDepth, &pool, frameCache.get(), resources, reportProgress)) {
+        std::cerr << "Failed to allocate pipeline frames" << std::endl;
+        return 1;
     }
     
     std::cout << "Finalizing video..." << std::endl;
     encoder.finish();
+    if (!printStats(options)) return 1;
     
-    std::cout << "Video saved as output_3d.mp4" << std::endl;
+    std::cout << "Video saved as " << options.output << std::endl;
     std::cout << "✓ 3D phone with proper thickness and depth!" << std::endl;
     std::cout << "✓ Camera bump visible during rotation!" << std::endl;
     std::cout << "✓ Rounded edges and realistic proportions!" << std::endl;
     std::cout << "✓ Traveling across screen with 3D rotation!" << std::endl;
     
     return 0;
-}
\ No newline at end of file
+}